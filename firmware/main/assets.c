@@ -0,0 +1,334 @@
+// Assets partition.
+// Read-only data for modules (lookup tables, audio, model weights) is stored as a
+// pack in the "assets" partition. Modules read it through a memory mapped view of
+// the partition, so the data is copied from flash straight into guest memory,
+// without going through FATFS, wear levelling and stdio buffers.
+//
+// A pack is built with tools/mkassets.py. It can be flashed to the partition
+// directly, or copied to the drive as ASSETS.BIN and imported on the next mount.
+//
+// Pack layout: assets_header_t, count * assets_entry_t, then the data of each
+// asset, 4-byte aligned. The CRC covers everything after the header.
+//
+// Several modules can read assets at the same time. The table is loaded once under
+// s_mutex and is read-only after that. It is only unloaded by an import, which
+// also holds s_mutex and never runs while a module is running.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "esp32s2/rom/crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "common.h"
+
+static const char* TAG = "assets";
+
+#define ASSETS_PARTITION_SUBTYPE    0x42
+#define ASSETS_MAGIC                0x54534157  /* "WAST" */
+#define ASSETS_VERSION              1
+#define ASSETS_MAX_COUNT            256
+#define ASSETS_NAME_LEN             24
+/* don't prefetch more than fits into the data cache */
+#define ASSETS_PREFETCH_MAX         (8 * 1024)
+#define ASSETS_CACHE_LINE_SIZE      32
+#define IMPORT_CHUNK_SIZE           4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t crc;
+    uint32_t total_size;
+} assets_header_t;
+
+typedef struct {
+    char name[ASSETS_NAME_LEN];     /* zero-padded, not terminated if 24 characters long */
+    uint32_t offset;                /* from the start of the pack */
+    uint32_t size;
+} assets_entry_t;
+
+static SemaphoreHandle_t s_mutex;
+static const esp_partition_t* s_part;
+/* set once the fields below are valid, readers check it without taking s_mutex */
+static atomic_bool s_loaded;
+static uint32_t s_count;
+static assets_entry_t* s_entries;
+static const uint8_t* s_map;
+static spi_flash_mmap_handle_t s_map_handle;
+
+/* protected by s_mutex */
+static uint64_t s_bytes_read;
+static int64_t s_read_time_us;
+
+static bool header_valid(const assets_header_t* hdr, size_t partition_size)
+{
+    return hdr->magic == ASSETS_MAGIC && hdr->version == ASSETS_VERSION && hdr->count <= ASSETS_MAX_COUNT &&
+           hdr->total_size <= partition_size &&
+           hdr->total_size >= sizeof(assets_header_t) + hdr->count * sizeof(assets_entry_t);
+}
+
+/* MB/s with two decimals, bytes per microsecond is MB/s */
+static void format_rate(char* out, size_t out_size, uint64_t bytes, int64_t time_us)
+{
+    uint32_t rate = (time_us > 0) ? (uint32_t) (bytes * 100 / time_us) : 0;
+    snprintf(out, out_size, "%u.%02u", rate / 100, rate % 100);
+}
+
+/* must be called with s_mutex held, and while no module is running */
+static void assets_unload(void)
+{
+    atomic_store(&s_loaded, false);
+    if (s_map != NULL) {
+        spi_flash_munmap(s_map_handle);
+        s_map = NULL;
+    }
+    free(s_entries);
+    s_entries = NULL;
+    s_count = 0;
+}
+
+/* must be called with s_mutex held */
+static esp_err_t assets_load(void)
+{
+    if (atomic_load(&s_loaded)) {
+        return ESP_OK;
+    }
+    s_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ASSETS_PARTITION_SUBTYPE, NULL);
+    if (s_part == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    assets_header_t hdr;
+    esp_err_t err = esp_partition_read(s_part, 0, &hdr, sizeof(hdr));
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (!header_valid(&hdr, s_part->size)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_entries = malloc(hdr.count * sizeof(assets_entry_t));
+    if (s_entries == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    err = esp_partition_read(s_part, sizeof(hdr), s_entries, hdr.count * sizeof(assets_entry_t));
+    if (err != ESP_OK) {
+        assets_unload();
+        return err;
+    }
+    for (uint32_t i = 0; i < hdr.count; ++i) {
+        if (s_entries[i].offset > hdr.total_size || s_entries[i].size > hdr.total_size - s_entries[i].offset) {
+            ESP_LOGE(TAG, "asset %d is out of bounds", i);
+            assets_unload();
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    s_count = hdr.count;
+
+    err = esp_partition_mmap(s_part, 0, hdr.total_size, SPI_FLASH_MMAP_DATA, (const void**) &s_map, &s_map_handle);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "can't map the assets partition (0x%x), using esp_partition_read", err);
+        s_map = NULL;
+    }
+    /* publishes the table and the mapping to readers */
+    atomic_store(&s_loaded, true);
+    return ESP_OK;
+}
+
+esp_err_t assets_init(void)
+{
+    s_mutex = xSemaphoreCreateMutex();
+    return (s_mutex != NULL) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+static esp_err_t import_pack(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ASSETS_PARTITION_SUBTYPE, NULL);
+    assets_header_t hdr;
+    if (part == NULL || fread(&hdr, sizeof(hdr), 1, f) != 1 || !header_valid(&hdr, part->size)) {
+        ESP_LOGW(TAG, "%s is not a valid asset pack, or it doesn't fit into the assets partition", path);
+        fclose(f);
+        return ESP_ERR_INVALID_ARG;
+    }
+    /* the header includes the CRC of the contents, so equal headers mean equal packs */
+    assets_header_t current;
+    if (esp_partition_read(part, 0, &current, sizeof(current)) == ESP_OK &&
+            memcmp(&hdr, &current, sizeof(hdr)) == 0) {
+        ESP_LOGI(TAG, "assets partition is up to date");
+        fclose(f);
+        return ESP_OK;
+    }
+    /* modules read the partition through the mapping, it can't be erased or unmapped under them */
+    if (wasm_running()) {
+        ESP_LOGW(TAG, "modules are still running, %s will be imported on the next mount", path);
+        fclose(f);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint8_t* buf = malloc(IMPORT_CHUNK_SIZE);
+    if (buf == NULL) {
+        fclose(f);
+        return ESP_ERR_NO_MEM;
+    }
+    assets_unload();
+    int64_t start = esp_timer_get_time();
+    int64_t file_read_us = 0;
+    uint32_t crc = 0;
+    /* the header is written last, an interrupted import leaves an empty partition */
+    size_t erase_size = (hdr.total_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    esp_err_t err = esp_partition_erase_range(part, 0, erase_size);
+    for (size_t offset = sizeof(hdr); offset < hdr.total_size && err == ESP_OK; ) {
+        size_t len = MIN(IMPORT_CHUNK_SIZE, hdr.total_size - offset);
+        int64_t read_start = esp_timer_get_time();
+        if (fread(buf, 1, len, f) != len) {
+            ESP_LOGE(TAG, "%s is truncated", path);
+            err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        file_read_us += esp_timer_get_time() - read_start;
+        crc = crc32_le(crc, buf, len);
+        err = esp_partition_write(part, offset, buf, len);
+        offset += len;
+    }
+    fclose(f);
+    if (err == ESP_OK && crc != hdr.crc) {
+        ESP_LOGE(TAG, "%s: CRC mismatch", path);
+        err = ESP_ERR_INVALID_CRC;
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(part, 0, &hdr, sizeof(hdr));
+    }
+    int64_t import_us = esp_timer_get_time() - start;
+    if (err != ESP_OK) {
+        free(buf);
+        ESP_LOGE(TAG, "import failed (0x%x)", err);
+        return err;
+    }
+
+    /* read the pack back through the mapped view to verify it, which also
+     * gives a comparison with the FATFS read rate above on the same data
+     */
+    err = assets_load();
+    if (err == ESP_OK && s_map != NULL) {
+        int64_t map_read_us = 0;
+        uint32_t verify_crc = 0;
+        for (size_t offset = sizeof(hdr); offset < hdr.total_size; offset += IMPORT_CHUNK_SIZE) {
+            size_t len = MIN(IMPORT_CHUNK_SIZE, hdr.total_size - offset);
+            int64_t read_start = esp_timer_get_time();
+            memcpy(buf, s_map + offset, len);
+            map_read_us += esp_timer_get_time() - read_start;
+            verify_crc = crc32_le(verify_crc, buf, len);
+        }
+        if (verify_crc != hdr.crc) {
+            ESP_LOGE(TAG, "assets partition doesn't match %s after import", path);
+            err = ESP_ERR_INVALID_CRC;
+        }
+        char file_rate[16];
+        char map_rate[16];
+        format_rate(file_rate, sizeof(file_rate), hdr.total_size - sizeof(hdr), file_read_us);
+        format_rate(map_rate, sizeof(map_rate), hdr.total_size - sizeof(hdr), map_read_us);
+        ESP_LOGI(TAG, "read rate: FATFS %s MB/s, mapped partition %s MB/s", file_rate, map_rate);
+    }
+    free(buf);
+    ESP_LOGI(TAG, "imported %d assets, %d bytes in %d ms",
+             hdr.count, hdr.total_size, (int) (import_us / 1000));
+    return err;
+}
+
+esp_err_t assets_import(const char* path)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    esp_err_t err = import_pack(path);
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+esp_err_t assets_open(const char* name, int* out_handle)
+{
+    if (strlen(name) > ASSETS_NAME_LEN) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    esp_err_t err = assets_load();
+    if (err == ESP_OK) {
+        err = ESP_ERR_NOT_FOUND;
+        for (uint32_t i = 0; i < s_count; ++i) {
+            if (strncmp(s_entries[i].name, name, ASSETS_NAME_LEN) == 0) {
+                *out_handle = (int) i;
+                err = ESP_OK;
+                break;
+            }
+        }
+    }
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+esp_err_t assets_size(int handle, size_t* out_size)
+{
+    if (!atomic_load(&s_loaded) || handle < 0 || (uint32_t) handle >= s_count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *out_size = s_entries[handle].size;
+    return ESP_OK;
+}
+
+esp_err_t assets_read(int handle, size_t offset, void* dest, size_t size, size_t* out_read)
+{
+    if (!atomic_load(&s_loaded) || handle < 0 || (uint32_t) handle >= s_count || offset > s_entries[handle].size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const assets_entry_t* entry = &s_entries[handle];
+    size = MIN(size, entry->size - offset);
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = ESP_OK;
+    if (s_map != NULL) {
+        memcpy(dest, s_map + entry->offset + offset, size);
+    } else {
+        err = esp_partition_read(s_part, entry->offset + offset, dest, size);
+    }
+    int64_t read_us = esp_timer_get_time() - start;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    s_read_time_us += read_us;
+    s_bytes_read += size;
+    xSemaphoreGive(s_mutex);
+    *out_read = size;
+    return err;
+}
+
+size_t assets_prefetch(int handle, size_t offset, size_t size)
+{
+    if (!atomic_load(&s_loaded) || s_map == NULL || handle < 0 || (uint32_t) handle >= s_count ||
+            offset > s_entries[handle].size) {
+        return 0;
+    }
+    size = MIN(MIN(size, s_entries[handle].size - offset), ASSETS_PREFETCH_MAX);
+    /* touching one byte per cache line pulls the range into the flash cache */
+    const volatile uint8_t* p = s_map + s_entries[handle].offset + offset;
+    for (size_t i = 0; i < size; i += ASSETS_CACHE_LINE_SIZE) {
+        (void) p[i];
+    }
+    return size;
+}
+
+void assets_log_stats(void)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    if (s_bytes_read > 0) {
+        char rate[16];
+        format_rate(rate, sizeof(rate), s_bytes_read, s_read_time_us);
+        ESP_LOGI(TAG, "%d bytes read from assets at %s MB/s", (int) s_bytes_read, rate);
+    }
+    s_bytes_read = 0;
+    s_read_time_us = 0;
+    xSemaphoreGive(s_mutex);
+}
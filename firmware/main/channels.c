@@ -0,0 +1,375 @@
+// Channels between modules.
+// Modules running at the same time pass messages through named channels. A channel
+// has one sender and one receiver, and is a ring of fixed-size slots allocated by
+// the firmware. The sender only writes the head index and the receiver only writes
+// the tail index, so sending and receiving don't take locks. A task which waits for
+// a free slot or for a message blocks on its task notification, and the other side
+// wakes it up.
+//
+// Every module has its own linear memory, so a message is copied once from the
+// sender's memory into a slot, and once from the slot into the receiver's memory.
+//
+// Channels belong to a group, the modules started together. An end which no module
+// of the group can open anymore is closed, so that its peer doesn't wait forever.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "common.h"
+
+static const char* TAG = "channels";
+
+#define CHANNEL_MAX_COUNT       8
+#define CHANNEL_NAME_LEN        16
+#define CHANNEL_MAX_SLOTS       256
+#define CHANNEL_MAX_MSG_SIZE    4096
+
+typedef enum {
+    SIDE_SEND,
+    SIDE_RECEIVE,
+} channel_side_t;
+
+typedef enum {
+    SIDE_IDLE,      /* not opened yet */
+    SIDE_OPEN,
+    SIDE_CLOSED,
+} side_state_t;
+
+typedef struct {
+    uint32_t size;
+    int64_t timestamp_us;
+} slot_header_t;
+
+typedef struct {
+    atomic_int state;
+    atomic_bool waiting;
+    TaskHandle_t task;          /* protected by s_mutex */
+} channel_end_t;
+
+typedef struct {
+    bool used;
+    uint32_t group;
+    char name[CHANNEL_NAME_LEN];
+    uint32_t msg_size;
+    uint32_t capacity;          /* power of two, so the free-running indices wrap correctly */
+    uint32_t slot_stride;
+    uint8_t* slots;
+    atomic_uint head;           /* messages sent, written by the sender only */
+    atomic_uint tail;           /* messages received, written by the receiver only */
+    channel_end_t ends[2];
+    /* statistics, written by the receiver only */
+    uint32_t messages;
+    int64_t first_send_us;
+    int64_t last_receive_us;
+    int64_t latency_sum_us;
+    uint32_t latency_min_us;
+    uint32_t latency_max_us;
+} channel_t;
+
+static channel_t s_channels[CHANNEL_MAX_COUNT];
+static SemaphoreHandle_t s_mutex;
+
+static channel_t* channel_from_handle(int handle, channel_side_t side)
+{
+    int index = handle >> 1;
+    if (handle < 0 || index >= CHANNEL_MAX_COUNT || (channel_side_t) (handle & 1) != side) {
+        return NULL;
+    }
+    channel_t* ch = &s_channels[index];
+    if (!ch->used || atomic_load(&ch->ends[side].state) != SIDE_OPEN) {
+        return NULL;
+    }
+    return ch;
+}
+
+static slot_header_t* slot(channel_t* ch, uint32_t index)
+{
+    return (slot_header_t*) (ch->slots + (index & (ch->capacity - 1)) * ch->slot_stride);
+}
+
+/* must be called with s_mutex held */
+static void wake_locked(channel_t* ch, channel_side_t side)
+{
+    channel_end_t* end = &ch->ends[side];
+    if (atomic_load(&end->waiting) && end->task != NULL) {
+        xTaskNotifyGive(end->task);
+    }
+}
+
+/* Wakes the other side if it waits. The mutex makes sure its task isn't deleted
+ * in between, and is only taken when a task actually waits.
+ */
+static void wake(channel_t* ch, channel_side_t side)
+{
+    if (atomic_load(&ch->ends[side].waiting)) {
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        wake_locked(ch, side);
+        xSemaphoreGive(s_mutex);
+    }
+}
+
+static bool can_send(channel_t* ch)
+{
+    return atomic_load(&ch->head) - atomic_load(&ch->tail) < ch->capacity ||
+           atomic_load(&ch->ends[SIDE_RECEIVE].state) == SIDE_CLOSED;
+}
+
+static bool can_receive(channel_t* ch)
+{
+    return atomic_load(&ch->head) != atomic_load(&ch->tail) ||
+           atomic_load(&ch->ends[SIDE_SEND].state) == SIDE_CLOSED;
+}
+
+/* Blocks until ready() returns true or the timeout expires. The waiting flag is
+ * set before ready() is checked again, so a wake-up from the other side can't get
+ * lost between the check and the wait.
+ */
+static bool wait_until(channel_t* ch, channel_side_t side, bool (*ready)(channel_t*), uint32_t timeout_ms)
+{
+    atomic_bool* waiting = &ch->ends[side].waiting;
+    int64_t deadline_us = esp_timer_get_time() + (int64_t) timeout_ms * 1000;
+    while (!ready(ch)) {
+        if (timeout_ms == 0) {
+            return false;
+        }
+        TickType_t ticks = portMAX_DELAY;
+        if (timeout_ms != CHANNEL_WAIT_FOREVER) {
+            int64_t left_us = deadline_us - esp_timer_get_time();
+            if (left_us <= 0) {
+                return false;
+            }
+            ticks = MAX(pdMS_TO_TICKS((left_us + 999) / 1000), 1);
+        }
+        atomic_store(waiting, true);
+        if (!ready(ch)) {
+            TRACE_BEGIN("channel_wait");
+            ulTaskNotifyTake(pdTRUE, ticks);
+            TRACE_END("channel_wait");
+        }
+        atomic_store(waiting, false);
+    }
+    return true;
+}
+
+static void log_stats(const channel_t* ch)
+{
+    if (ch->messages == 0) {
+        ESP_LOGI(TAG, "%s: no messages received", ch->name);
+        return;
+    }
+    int64_t duration_us = ch->last_receive_us - ch->first_send_us;
+    ESP_LOGI(TAG, "%s: %d messages, %d msg/s, latency avg %d us, min %d us, max %d us",
+             ch->name, ch->messages, (int) (duration_us > 0 ? ch->messages * 1000000LL / duration_us : 0),
+             (int) (ch->latency_sum_us / ch->messages), ch->latency_min_us, ch->latency_max_us);
+}
+
+/* must be called with s_mutex held */
+static void channel_free(channel_t* ch)
+{
+    log_stats(ch);
+    free(ch->slots);
+    memset(ch, 0, sizeof(*ch));
+}
+
+esp_err_t channels_init(void)
+{
+    s_mutex = xSemaphoreCreateMutex();
+    return (s_mutex != NULL) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t channels_open(uint32_t group, const char* name, channel_mode_t mode, size_t msg_size, size_t capacity,
+                        int* out_handle)
+{
+    if (strlen(name) == 0 || strlen(name) >= CHANNEL_NAME_LEN ||
+            (mode != CHANNEL_MODE_SEND && mode != CHANNEL_MODE_RECEIVE) ||
+            msg_size > CHANNEL_MAX_MSG_SIZE || capacity > CHANNEL_MAX_SLOTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    channel_side_t side = (mode == CHANNEL_MODE_SEND) ? SIDE_SEND : SIDE_RECEIVE;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    channel_t* ch = NULL;
+    channel_t* free_ch = NULL;
+    for (int i = 0; i < CHANNEL_MAX_COUNT; ++i) {
+        if (s_channels[i].used && s_channels[i].group == group && strcmp(s_channels[i].name, name) == 0) {
+            ch = &s_channels[i];
+            break;
+        }
+        if (!s_channels[i].used && free_ch == NULL) {
+            free_ch = &s_channels[i];
+        }
+    }
+
+    if (ch != NULL) {
+        /* the other side created it, zero sizes accept whatever it asked for */
+        if (atomic_load(&ch->ends[side].state) != SIDE_IDLE) {
+            err = ESP_ERR_INVALID_STATE;
+        } else if ((msg_size != 0 && msg_size != ch->msg_size) ||
+                   (capacity != 0 && capacity > ch->capacity)) {
+            err = ESP_ERR_INVALID_SIZE;
+        }
+    } else if (free_ch == NULL) {
+        err = ESP_ERR_NO_MEM;
+    } else if (msg_size == 0 || capacity == 0) {
+        err = ESP_ERR_INVALID_ARG;
+    } else {
+        ch = free_ch;
+        uint32_t rounded = 1;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        uint32_t stride = (sizeof(slot_header_t) + msg_size + 7) & ~7;
+        ch->slots = malloc(rounded * stride);
+        if (ch->slots == NULL) {
+            ch = NULL;
+            err = ESP_ERR_NO_MEM;
+        } else {
+            ch->used = true;
+            ch->group = group;
+            strlcpy(ch->name, name, sizeof(ch->name));
+            ch->msg_size = msg_size;
+            ch->capacity = rounded;
+            ch->slot_stride = stride;
+            ch->latency_min_us = UINT32_MAX;
+            ESP_LOGI(TAG, "%s: %d slots of %d bytes", name, rounded, msg_size);
+        }
+    }
+    if (err == ESP_OK) {
+        ch->ends[side].task = xTaskGetCurrentTaskHandle();
+        atomic_store(&ch->ends[side].state, SIDE_OPEN);
+        *out_handle = (int) ((ch - s_channels) << 1) | side;
+    }
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+esp_err_t channels_send(int handle, const void* data, size_t size, uint32_t timeout_ms)
+{
+    channel_t* ch = channel_from_handle(handle, SIDE_SEND);
+    if (ch == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (size > ch->msg_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (!wait_until(ch, SIDE_SEND, can_send, timeout_ms)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (atomic_load(&ch->ends[SIDE_RECEIVE].state) == SIDE_CLOSED) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint32_t head = atomic_load(&ch->head);
+    slot_header_t* hdr = slot(ch, head);
+    memcpy(hdr + 1, data, size);
+    hdr->size = size;
+    hdr->timestamp_us = esp_timer_get_time();
+    /* publishes the slot to the receiver */
+    atomic_store(&ch->head, head + 1);
+    wake(ch, SIDE_RECEIVE);
+    return ESP_OK;
+}
+
+esp_err_t channels_receive(int handle, void* dest, size_t max_size, size_t* out_size, uint32_t timeout_ms)
+{
+    channel_t* ch = channel_from_handle(handle, SIDE_RECEIVE);
+    if (ch == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!wait_until(ch, SIDE_RECEIVE, can_receive, timeout_ms)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    uint32_t tail = atomic_load(&ch->tail);
+    if (atomic_load(&ch->head) == tail) {
+        /* the sender has closed the channel, and all its messages were received */
+        return ESP_ERR_INVALID_STATE;
+    }
+    const slot_header_t* hdr = slot(ch, tail);
+    if (hdr->size > max_size) {
+        /* the message stays in the channel, it can be received into a larger buffer */
+        *out_size = hdr->size;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dest, hdr + 1, hdr->size);
+    *out_size = hdr->size;
+
+    int64_t now = esp_timer_get_time();
+    uint32_t latency_us = (uint32_t) (now - hdr->timestamp_us);
+    if (ch->messages == 0) {
+        ch->first_send_us = hdr->timestamp_us;
+    }
+    ch->messages++;
+    ch->last_receive_us = now;
+    ch->latency_sum_us += latency_us;
+    ch->latency_min_us = MIN(ch->latency_min_us, latency_us);
+    ch->latency_max_us = MAX(ch->latency_max_us, latency_us);
+
+    /* frees the slot for the sender */
+    atomic_store(&ch->tail, tail + 1);
+    wake(ch, SIDE_SEND);
+    return ESP_OK;
+}
+
+void channels_close(int handle)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    channel_side_t side = (channel_side_t) (handle & 1);
+    channel_t* ch = channel_from_handle(handle, side);
+    if (ch != NULL) {
+        ch->ends[side].task = NULL;
+        atomic_store(&ch->ends[side].state, SIDE_CLOSED);
+        /* the other side may wait for a message or a slot which will never come */
+        channel_side_t other = (side == SIDE_SEND) ? SIDE_RECEIVE : SIDE_SEND;
+        wake_locked(ch, other);
+        if (atomic_load(&ch->ends[other].state) == SIDE_CLOSED) {
+            channel_free(ch);
+        }
+    }
+    xSemaphoreGive(s_mutex);
+}
+
+void channels_close_unopened(uint32_t group, bool (*may_open)(const char* name, void* arg), void* arg)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    for (int i = 0; i < CHANNEL_MAX_COUNT; ++i) {
+        channel_t* ch = &s_channels[i];
+        if (!ch->used || ch->group != group) {
+            continue;
+        }
+        bool idle = atomic_load(&ch->ends[SIDE_SEND].state) == SIDE_IDLE ||
+                    atomic_load(&ch->ends[SIDE_RECEIVE].state) == SIDE_IDLE;
+        if (!idle || may_open(ch->name, arg)) {
+            continue;
+        }
+        for (int side = SIDE_SEND; side <= SIDE_RECEIVE; ++side) {
+            if (atomic_load(&ch->ends[side].state) == SIDE_IDLE) {
+                ESP_LOGW(TAG, "%s: no module left to open the %s end", ch->name,
+                         (side == SIDE_SEND) ? "sending" : "receiving");
+                atomic_store(&ch->ends[side].state, SIDE_CLOSED);
+                wake_locked(ch, (side == SIDE_SEND) ? SIDE_RECEIVE : SIDE_SEND);
+            }
+        }
+        if (atomic_load(&ch->ends[SIDE_SEND].state) == SIDE_CLOSED &&
+                atomic_load(&ch->ends[SIDE_RECEIVE].state) == SIDE_CLOSED) {
+            channel_free(ch);
+        }
+    }
+    xSemaphoreGive(s_mutex);
+}
+
+void channels_reset(void)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    /* channels one side never opened are only freed here */
+    for (int i = 0; i < CHANNEL_MAX_COUNT; ++i) {
+        if (s_channels[i].used) {
+            channel_free(&s_channels[i]);
+        }
+    }
+    xSemaphoreGive(s_mutex);
+}
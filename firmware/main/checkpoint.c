@@ -0,0 +1,183 @@
+// Guest checkpoints.
+// A checkpoint holds the linear memory and globals of a module, and is stored in
+// the "checkpoint" partition: a header sector followed by one flash sector per
+// 4 kB memory page. The header has a CRC of every page, so a new checkpoint only
+// rewrites the pages whose contents changed since the previous one.
+//
+// Saving erases the header first and writes it back last, so a reset in between
+// leaves no checkpoint rather than a mix of old and new pages.
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp32s2/rom/crc.h"
+#include "common.h"
+
+static const char* TAG = "checkpoint";
+
+#define CHECKPOINT_PARTITION_SUBTYPE    0x41
+#define CHECKPOINT_MAGIC                0x54504b43  /* "CKPT" */
+#define CHECKPOINT_PAGE_SIZE            SPI_FLASH_SEC_SIZE
+#define CHECKPOINT_MAX_PAGES            512
+
+typedef struct {
+    uint32_t magic;
+    uint32_t module_hash;
+    uint32_t memory_size;
+    uint32_t global_count;
+    uint32_t cold_start_ms;
+    uint64_t globals[CHECKPOINT_MAX_GLOBALS];
+    uint32_t page_crc[CHECKPOINT_MAX_PAGES];
+    uint32_t header_crc;        /* over all the fields above */
+} checkpoint_header_t;
+
+_Static_assert(sizeof(checkpoint_header_t) <= CHECKPOINT_PAGE_SIZE, "checkpoint header must fit into one sector");
+
+static const esp_partition_t* find_partition(void)
+{
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, CHECKPOINT_PARTITION_SUBTYPE, NULL);
+}
+
+static uint32_t header_crc(const checkpoint_header_t* hdr)
+{
+    return crc32_le(0, (const uint8_t*) hdr, offsetof(checkpoint_header_t, header_crc));
+}
+
+/* Reads the header, returns false if there is no valid checkpoint */
+static bool read_header(const esp_partition_t* part, checkpoint_header_t* hdr)
+{
+    if (esp_partition_read(part, 0, hdr, sizeof(*hdr)) != ESP_OK) {
+        return false;
+    }
+    return hdr->magic == CHECKPOINT_MAGIC && hdr->header_crc == header_crc(hdr) &&
+           hdr->global_count <= CHECKPOINT_MAX_GLOBALS &&
+           hdr->memory_size <= CHECKPOINT_MAX_PAGES * CHECKPOINT_PAGE_SIZE &&
+           hdr->memory_size % CHECKPOINT_PAGE_SIZE == 0;
+}
+
+esp_err_t checkpoint_save(uint32_t module_hash, const uint8_t* memory, size_t memory_size,
+                          const uint64_t* globals, size_t global_count, uint32_t cold_start_ms)
+{
+    const esp_partition_t* part = find_partition();
+    if (part == NULL) {
+        ESP_LOGE(TAG, "no checkpoint partition");
+        return ESP_ERR_NOT_FOUND;
+    }
+    size_t page_count = (memory_size + CHECKPOINT_PAGE_SIZE - 1) / CHECKPOINT_PAGE_SIZE;
+    if (memory_size % CHECKPOINT_PAGE_SIZE != 0 || page_count > CHECKPOINT_MAX_PAGES ||
+            (1 + page_count) * CHECKPOINT_PAGE_SIZE > part->size || global_count > CHECKPOINT_MAX_GLOBALS) {
+        ESP_LOGE(TAG, "%d bytes of memory and %d globals don't fit into the checkpoint partition",
+                 memory_size, global_count);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    checkpoint_header_t* old_hdr = calloc(1, sizeof(checkpoint_header_t));
+    checkpoint_header_t* hdr = calloc(1, sizeof(checkpoint_header_t));
+    if (old_hdr == NULL || hdr == NULL) {
+        free(old_hdr);
+        free(hdr);
+        return ESP_ERR_NO_MEM;
+    }
+    int64_t start = esp_timer_get_time();
+    /* page CRCs of the previous checkpoint describe what is in flash now, whichever module it was for */
+    size_t old_page_count = read_header(part, old_hdr) ? old_hdr->memory_size / CHECKPOINT_PAGE_SIZE : 0;
+
+    hdr->magic = CHECKPOINT_MAGIC;
+    hdr->module_hash = module_hash;
+    hdr->memory_size = memory_size;
+    hdr->global_count = global_count;
+    hdr->cold_start_ms = cold_start_ms;
+    memcpy(hdr->globals, globals, global_count * sizeof(uint64_t));
+    for (size_t i = 0; i < page_count; ++i) {
+        hdr->page_crc[i] = crc32_le(0, memory + i * CHECKPOINT_PAGE_SIZE, CHECKPOINT_PAGE_SIZE);
+    }
+    hdr->header_crc = header_crc(hdr);
+
+    size_t written = 0;
+    esp_err_t err = esp_partition_erase_range(part, 0, CHECKPOINT_PAGE_SIZE);
+    for (size_t i = 0; i < page_count && err == ESP_OK; ++i) {
+        if (i < old_page_count && old_hdr->page_crc[i] == hdr->page_crc[i]) {
+            continue;
+        }
+        size_t offset = (1 + i) * CHECKPOINT_PAGE_SIZE;
+        err = esp_partition_erase_range(part, offset, CHECKPOINT_PAGE_SIZE);
+        if (err == ESP_OK) {
+            err = esp_partition_write(part, offset, memory + i * CHECKPOINT_PAGE_SIZE, CHECKPOINT_PAGE_SIZE);
+        }
+        written++;
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(part, 0, hdr, sizeof(*hdr));
+    }
+    free(old_hdr);
+    free(hdr);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "failed to write checkpoint (0x%x)", err);
+        return err;
+    }
+    ESP_LOGI(TAG, "saved checkpoint: %d of %d pages written, %d ms",
+             written, page_count, (int) ((esp_timer_get_time() - start) / 1000));
+    return ESP_OK;
+}
+
+bool checkpoint_find(uint32_t module_hash, checkpoint_info_t* out_info)
+{
+    const esp_partition_t* part = find_partition();
+    if (part == NULL) {
+        return false;
+    }
+    checkpoint_header_t* hdr = malloc(sizeof(checkpoint_header_t));
+    if (hdr == NULL) {
+        return false;
+    }
+    bool found = read_header(part, hdr) && hdr->module_hash == module_hash;
+    if (found) {
+        out_info->memory_size = hdr->memory_size;
+        out_info->global_count = hdr->global_count;
+        out_info->cold_start_ms = hdr->cold_start_ms;
+    }
+    free(hdr);
+    return found;
+}
+
+esp_err_t checkpoint_restore(uint8_t* memory, size_t memory_size, uint64_t* globals, size_t global_count)
+{
+    const esp_partition_t* part = find_partition();
+    if (part == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    checkpoint_header_t* hdr = malloc(sizeof(checkpoint_header_t));
+    if (hdr == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_OK;
+    if (!read_header(part, hdr)) {
+        err = ESP_ERR_NOT_FOUND;
+    } else if (hdr->memory_size != memory_size || hdr->global_count != global_count) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t i = 0; i < memory_size / CHECKPOINT_PAGE_SIZE && err == ESP_OK; ++i) {
+        uint8_t* page = memory + i * CHECKPOINT_PAGE_SIZE;
+        err = esp_partition_read(part, (1 + i) * CHECKPOINT_PAGE_SIZE, page, CHECKPOINT_PAGE_SIZE);
+        if (err == ESP_OK && crc32_le(0, page, CHECKPOINT_PAGE_SIZE) != hdr->page_crc[i]) {
+            ESP_LOGE(TAG, "page %d is corrupted", i);
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    if (err == ESP_OK) {
+        memcpy(globals, hdr->globals, global_count * sizeof(uint64_t));
+    }
+    free(hdr);
+    return err;
+}
+
+void checkpoint_discard(void)
+{
+    const esp_partition_t* part = find_partition();
+    if (part != NULL) {
+        esp_partition_erase_range(part, 0, CHECKPOINT_PAGE_SIZE);
+    }
+}
@@ -2,7 +2,10 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "esp_err.h"
+#include "governor_policy.h"
+#include "trace.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,11 +15,27 @@ extern "C" {
 
 esp_err_t storage_init_wl(void);
 esp_err_t storage_mount_fat(const char* base_path);
+/* true if the last storage_mount_fat() found no filesystem and formatted the volume */
+bool storage_fat_formatted(void);
 size_t storage_get_size(void);
 size_t storage_get_sector_size(void);
 esp_err_t storage_unmount_fat(void);
 esp_err_t storage_read_sector(size_t addr, size_t size, void* dest);
 esp_err_t storage_write_sector(size_t addr, size_t size, const void* src);
+void storage_cache_log_stats(void);
+/* access to the flash-backed volume, bypassing the staging RAM disk */
+esp_err_t storage_flash_read(size_t addr, size_t size, void* dest);
+esp_err_t storage_flash_write(size_t addr, size_t size, const void* src);
+size_t storage_fat_meta_size(const uint8_t* boot_sector, size_t sector_size);
+bool storage_fat_boot_offset(const uint8_t* sector0, size_t sector_size, size_t* out_offset);
+
+esp_err_t staging_enable(void);
+bool staging_active(void);
+esp_err_t staging_read(size_t addr, size_t size, void* dest);
+esp_err_t staging_write(size_t addr, size_t size, const void* src);
+esp_err_t staging_register_diskio(uint8_t pdrv);
+void staging_commit(void);
+esp_err_t staging_recover(void);
 
 void status_init(void);
 void status_red(void);
@@ -24,19 +43,153 @@ void status_green(void);
 void status_blue(void);
 void status_rgb(int r, int g, int b);
 
+#define SETTINGS_MAX_MODULE_OVERRIDES 8
+
+typedef struct {
+    char module_name[32];
+    governor_level_t pm_run_level;
+} wasm_module_settings_t;
+
 typedef struct {
     size_t wasm_task_stack_size;
     size_t wasm_env_stack_size;
+    governor_config_t governor;
+    bool msc_staging;
+    char run_modules[96];       /* comma-separated, run at the same time instead of the latest file */
+    wasm_module_settings_t modules[SETTINGS_MAX_MODULE_OVERRIDES];
+    size_t module_count;
 } wasm_example_settings_t;
 
 esp_err_t settings_load(const char* filename, wasm_example_settings_t* out_settings);
+governor_level_t settings_get_run_level(const wasm_example_settings_t* settings, const char* module_name);
+
+esp_err_t governor_init(void);
+void governor_configure(const governor_config_t* config);
+void governor_activity_begin(governor_activity_t activity);
+void governor_activity_end(governor_activity_t activity);
+/* GOVERNOR_ACTIVITY_RUN of a module running at the given level, the highest level of the running modules applies */
+void governor_run_begin(governor_level_t level);
+void governor_run_end(governor_level_t level);
+void governor_usb_transfer(void);
+void governor_set_usb_present(bool present);
+void governor_log_residency(void);
 
 void msc_allow_mount(bool allow);
 void msc_on_eject(void);
 
 void usb_init(void);
 
-void wasm_run(const char* wasm_file_name, size_t wasm_task_stack_size, size_t wasm_env_stack_size);
+typedef enum {
+    EVENT_TIMER = 1,
+    EVENT_GPIO = 2,
+    EVENT_USER = 3,
+} event_type_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t id;
+    int32_t value;
+    int64_t timestamp_us;
+} event_t;
+
+/* events of one module */
+typedef struct events_ctx events_ctx_t;
+
+esp_err_t events_init(void);
+esp_err_t events_create(events_ctx_t** out_ctx);
+esp_err_t events_timer_start(events_ctx_t* ctx, uint32_t id, uint32_t period_ms, bool periodic);
+esp_err_t events_timer_stop(events_ctx_t* ctx, uint32_t id);
+esp_err_t events_gpio_watch(events_ctx_t* ctx, int gpio_num, int edge);
+esp_err_t events_gpio_unwatch(events_ctx_t* ctx, int gpio_num);
+esp_err_t events_post(events_ctx_t* ctx, uint32_t id, int32_t value);
+bool events_pending(events_ctx_t* ctx);
+bool events_wait(events_ctx_t* ctx, event_t* out_event, uint32_t timeout_ms);
+void events_destroy(events_ctx_t* ctx);
+
+typedef enum {
+    WASM_FORMAT_UNKNOWN,
+    WASM_FORMAT_PLAIN,
+    WASM_FORMAT_GZIP,
+    WASM_FORMAT_LZ4,
+} wasm_format_t;
+
+wasm_format_t wasm_detect_format(const uint8_t* hdr, size_t size);
+const char* wasm_format_name(wasm_format_t format);
+/* format from the first bytes of a file, cheap enough to call for every file on the drive */
+wasm_format_t wasm_file_format(const char* filename);
+/* format of a module file, WASM_FORMAT_UNKNOWN if the file isn't a module. Compressed
+ * files are decompressed up to the module header, which needs the full decompression window.
+ */
+wasm_format_t wasm_probe_file(const char* filename);
+esp_err_t wasm_file_hash(const char* filename, uint32_t* out_hash);
+
+typedef struct {
+    uint32_t task_stack_used;
+    uint32_t env_stack_used;
+} stack_profile_t;
+
+void stack_profile_init(void);
+void stack_profile_apply(uint32_t module_hash, size_t* task_stack_size, size_t* env_stack_size);
+typedef enum {
+    STACK_PROFILE_COMPLETED,    /* returned or called proc_exit, the measurement is recorded */
+    STACK_PROFILE_OVERFLOW,     /* ran out of stack, the profile is dropped */
+    STACK_PROFILE_FAILED,       /* failed otherwise, the profile is left as it is */
+} stack_profile_result_t;
+
+void stack_profile_update(uint32_t module_hash, const stack_profile_t* measured, stack_profile_result_t result);
+
+#define CHECKPOINT_MAX_GLOBALS 64
+
+typedef struct {
+    uint32_t memory_size;
+    uint32_t global_count;
+    uint32_t cold_start_ms;     /* time from _start to the checkpoint on the first run */
+} checkpoint_info_t;
+
+esp_err_t checkpoint_save(uint32_t module_hash, const uint8_t* memory, size_t memory_size,
+                          const uint64_t* globals, size_t global_count, uint32_t cold_start_ms);
+bool checkpoint_find(uint32_t module_hash, checkpoint_info_t* out_info);
+esp_err_t checkpoint_restore(uint8_t* memory, size_t memory_size, uint64_t* globals, size_t global_count);
+void checkpoint_discard(void);
+
+esp_err_t assets_init(void);
+esp_err_t assets_import(const char* path);
+esp_err_t assets_open(const char* name, int* out_handle);
+esp_err_t assets_size(int handle, size_t* out_size);
+esp_err_t assets_read(int handle, size_t offset, void* dest, size_t size, size_t* out_read);
+size_t assets_prefetch(int handle, size_t offset, size_t size);
+void assets_log_stats(void);
+
+#define CHANNEL_WAIT_FOREVER UINT32_MAX
+
+typedef enum {
+    CHANNEL_MODE_SEND = 1,
+    CHANNEL_MODE_RECEIVE = 2,
+} channel_mode_t;
+
+esp_err_t channels_init(void);
+/* channels are matched by name within a group, the modules started together */
+esp_err_t channels_open(uint32_t group, const char* name, channel_mode_t mode, size_t msg_size, size_t capacity,
+                        int* out_handle);
+esp_err_t channels_send(int handle, const void* data, size_t size, uint32_t timeout_ms);
+esp_err_t channels_receive(int handle, void* dest, size_t max_size, size_t* out_size, uint32_t timeout_ms);
+void channels_close(int handle);
+/* Closes the never opened ends of the group's channels for which may_open() returns
+ * false, waking their peers. Call it whenever a module of the group may have been
+ * the last one able to open them.
+ */
+void channels_close_unopened(uint32_t group, bool (*may_open)(const char* name, void* arg), void* arg);
+void channels_reset(void);
+
+/* Starts the modules of one run at the same time, each in its own task. The first
+ * one is the primary, it owns checkpoints and stack profiles until the next run
+ * starts. Modules of a run share channels. run_levels holds the governor level
+ * of each module while its guest code runs.
+ */
+void wasm_run(const char* const* wasm_file_names, const governor_level_t* run_levels, size_t count,
+              size_t wasm_task_stack_size, size_t wasm_env_stack_size);
+/* true while a module of any run is still running */
+bool wasm_running(void);
 
 #ifdef __cplusplus
 }
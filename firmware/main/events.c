@@ -0,0 +1,298 @@
+// Guest events.
+// Each running module gets its own event context: a queue, timers and watched
+// GPIOs. Contexts come from a fixed pool and are reused, never freed, so a timer
+// callback or GPIO interrupt racing with events_destroy() can't touch freed memory.
+
+#include <string.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "common.h"
+
+static const char* TAG = "events";
+
+#define EVENT_QUEUE_LEN     16
+#define EVENT_MAX_TIMERS    8
+#define EVENT_MAX_CONTEXTS  4
+#define EVENT_MAX_GPIOS     64
+
+#ifndef CONFIG_WASM_DEMO_GUEST_GPIO_MASK
+#define CONFIG_WASM_DEMO_GUEST_GPIO_MASK 0x7FE0023FFFF
+#endif
+/* pins a module may reconfigure, the LED belongs to the firmware */
+#define GUEST_GPIO_MASK     ((uint64_t) CONFIG_WASM_DEMO_GUEST_GPIO_MASK & ~(1ULL << LED_GPIO))
+
+typedef struct {
+    events_ctx_t* ctx;
+    uint32_t id;
+    esp_timer_handle_t handle;
+    bool active;
+    bool periodic;
+} event_timer_t;
+
+struct events_ctx {
+    bool used;
+    QueueHandle_t queue;
+    event_timer_t timers[EVENT_MAX_TIMERS];
+    uint64_t gpio_watched;
+    volatile uint32_t dropped;
+    uint32_t latency_count;
+    int64_t latency_sum;
+    int64_t latency_min;
+    int64_t latency_max;
+};
+
+static events_ctx_t s_contexts[EVENT_MAX_CONTEXTS];
+/* a GPIO interrupt can only be delivered to one module, the one watching it */
+static events_ctx_t* s_gpio_owner[EVENT_MAX_GPIOS];
+static SemaphoreHandle_t s_mutex;
+static bool s_isr_service_installed;
+
+static bool queue_event(events_ctx_t* ctx, uint32_t type, uint32_t id, int32_t value)
+{
+    event_t ev = {
+        .type = type,
+        .id = id,
+        .value = value,
+        .timestamp_us = esp_timer_get_time(),
+    };
+    if (xQueueSend(ctx->queue, &ev, 0) != pdTRUE) {
+        ctx->dropped++;
+        return false;
+    }
+    return true;
+}
+
+static void timer_cb(void* arg)
+{
+    event_timer_t* timer = (event_timer_t*) arg;
+    if (!queue_event(timer->ctx, EVENT_TIMER, timer->id, 0) && !timer->periodic) {
+        /* the event is dropped, count it as delivered, or events_pending() never turns false */
+        timer->active = false;
+    }
+}
+
+static void IRAM_ATTR gpio_isr(void* arg)
+{
+    uint32_t gpio_num = (uint32_t) arg;
+    events_ctx_t* ctx = s_gpio_owner[gpio_num];
+    if (ctx == NULL) {
+        return;
+    }
+    event_t ev = {
+        .type = EVENT_GPIO,
+        .id = gpio_num,
+        .value = gpio_get_level(gpio_num),
+        .timestamp_us = esp_timer_get_time(),
+    };
+    BaseType_t need_yield = pdFALSE;
+    if (xQueueSendFromISR(ctx->queue, &ev, &need_yield) != pdTRUE) {
+        ctx->dropped++;
+    }
+    if (need_yield) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+esp_err_t events_init(void)
+{
+    s_mutex = xSemaphoreCreateMutex();
+    return (s_mutex != NULL) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t events_create(events_ctx_t** out_ctx)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    events_ctx_t* ctx = NULL;
+    for (int i = 0; i < EVENT_MAX_CONTEXTS; ++i) {
+        if (!s_contexts[i].used) {
+            ctx = &s_contexts[i];
+            break;
+        }
+    }
+    esp_err_t err = ESP_OK;
+    if (ctx == NULL) {
+        err = ESP_ERR_NO_MEM;
+    } else if (ctx->queue == NULL) {
+        ctx->queue = xQueueCreate(EVENT_QUEUE_LEN, sizeof(event_t));
+        if (ctx->queue == NULL) {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    if (err == ESP_OK) {
+        ctx->used = true;
+        *out_ctx = ctx;
+    }
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+esp_err_t events_timer_start(events_ctx_t* ctx, uint32_t id, uint32_t period_ms, bool periodic)
+{
+    if (id >= EVENT_MAX_TIMERS || period_ms == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    event_timer_t* timer = &ctx->timers[id];
+    if (timer->handle == NULL) {
+        timer->ctx = ctx;
+        timer->id = id;
+        const esp_timer_create_args_t args = {
+            .callback = &timer_cb,
+            .arg = timer,
+            .name = "guest_timer",
+        };
+        esp_err_t err = esp_timer_create(&args, &timer->handle);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    if (timer->active) {
+        esp_timer_stop(timer->handle);
+    }
+    uint64_t period_us = (uint64_t) period_ms * 1000;
+    timer->periodic = periodic;
+    esp_err_t err = periodic ? esp_timer_start_periodic(timer->handle, period_us)
+                             : esp_timer_start_once(timer->handle, period_us);
+    timer->active = (err == ESP_OK);
+    return err;
+}
+
+esp_err_t events_timer_stop(events_ctx_t* ctx, uint32_t id)
+{
+    if (id >= EVENT_MAX_TIMERS || ctx->timers[id].handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_timer_stop(ctx->timers[id].handle);
+    ctx->timers[id].active = false;
+    return ESP_OK;
+}
+
+esp_err_t events_gpio_watch(events_ctx_t* ctx, int gpio_num, int edge)
+{
+    if (!GPIO_IS_VALID_GPIO(gpio_num) || gpio_num < 0 || gpio_num >= EVENT_MAX_GPIOS ||
+            edge < GPIO_INTR_POSEDGE || edge > GPIO_INTR_ANYEDGE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!(GUEST_GPIO_MASK & (1ULL << gpio_num))) {
+        ESP_LOGW(TAG, "GPIO %d is reserved for the firmware", gpio_num);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (s_gpio_owner[gpio_num] != NULL && s_gpio_owner[gpio_num] != ctx) {
+        ESP_LOGW(TAG, "GPIO %d is watched by another module", gpio_num);
+        err = ESP_ERR_INVALID_STATE;
+    } else if (!s_isr_service_installed) {
+        err = gpio_install_isr_service(0);
+        if (err == ESP_ERR_INVALID_STATE) {
+            err = ESP_OK;
+        }
+        s_isr_service_installed = (err == ESP_OK);
+    }
+    if (err == ESP_OK) {
+        gpio_set_direction(gpio_num, GPIO_MODE_INPUT);
+        gpio_set_intr_type(gpio_num, (gpio_int_type_t) edge);
+        s_gpio_owner[gpio_num] = ctx;
+        err = gpio_isr_handler_add(gpio_num, &gpio_isr, (void*) gpio_num);
+    }
+    if (err == ESP_OK) {
+        ctx->gpio_watched |= (1ULL << gpio_num);
+        err = gpio_intr_enable(gpio_num);
+    } else if (s_gpio_owner[gpio_num] == ctx && !(ctx->gpio_watched & (1ULL << gpio_num))) {
+        s_gpio_owner[gpio_num] = NULL;
+    }
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+esp_err_t events_gpio_unwatch(events_ctx_t* ctx, int gpio_num)
+{
+    /* a pin is only watched if GUEST_GPIO_MASK allowed it */
+    if (!GPIO_IS_VALID_GPIO(gpio_num) || gpio_num < 0 || gpio_num >= EVENT_MAX_GPIOS ||
+            !(ctx->gpio_watched & (1ULL << gpio_num))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    gpio_intr_disable(gpio_num);
+    gpio_isr_handler_remove(gpio_num);
+    s_gpio_owner[gpio_num] = NULL;
+    ctx->gpio_watched &= ~(1ULL << gpio_num);
+    xSemaphoreGive(s_mutex);
+    return ESP_OK;
+}
+
+esp_err_t events_post(events_ctx_t* ctx, uint32_t id, int32_t value)
+{
+    return queue_event(ctx, EVENT_USER, id, value) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+bool events_pending(events_ctx_t* ctx)
+{
+    if (uxQueueMessagesWaiting(ctx->queue) > 0 || ctx->gpio_watched != 0) {
+        return true;
+    }
+    for (int i = 0; i < EVENT_MAX_TIMERS; ++i) {
+        /* one-shot timers clear themselves only once their event is dispatched */
+        if (ctx->timers[i].active) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool events_wait(events_ctx_t* ctx, event_t* out_event, uint32_t timeout_ms)
+{
+    TickType_t ticks = (timeout_ms == UINT32_MAX) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    if (xQueueReceive(ctx->queue, out_event, ticks) != pdTRUE) {
+        return false;
+    }
+    if (out_event->type == EVENT_TIMER && out_event->id < EVENT_MAX_TIMERS &&
+            !ctx->timers[out_event->id].periodic) {
+        ctx->timers[out_event->id].active = false;
+    }
+
+    int64_t latency = esp_timer_get_time() - out_event->timestamp_us;
+    if (ctx->latency_count == 0) {
+        ctx->latency_min = latency;
+        ctx->latency_max = latency;
+    } else {
+        ctx->latency_min = MIN(ctx->latency_min, latency);
+        ctx->latency_max = MAX(ctx->latency_max, latency);
+    }
+    ctx->latency_sum += latency;
+    ctx->latency_count++;
+    return true;
+}
+
+void events_destroy(events_ctx_t* ctx)
+{
+    for (int i = 0; i < EVENT_MAX_TIMERS; ++i) {
+        if (ctx->timers[i].handle != NULL) {
+            esp_timer_stop(ctx->timers[i].handle);
+            ctx->timers[i].active = false;
+        }
+    }
+    for (int gpio_num = 0; gpio_num < EVENT_MAX_GPIOS; ++gpio_num) {
+        if (ctx->gpio_watched & (1ULL << gpio_num)) {
+            events_gpio_unwatch(ctx, gpio_num);
+        }
+    }
+    xQueueReset(ctx->queue);
+
+    if (ctx->latency_count > 0) {
+        ESP_LOGI(TAG, "%d events dispatched, %d dropped, latency min/avg/max: %d/%d/%d us",
+                 ctx->latency_count, ctx->dropped, (int) ctx->latency_min,
+                 (int) (ctx->latency_sum / ctx->latency_count), (int) ctx->latency_max);
+    }
+    ctx->latency_count = 0;
+    ctx->latency_sum = 0;
+    ctx->dropped = 0;
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    ctx->used = false;
+    xSemaphoreGive(s_mutex);
+}
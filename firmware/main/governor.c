@@ -0,0 +1,243 @@
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+#include "common.h"
+
+static const char* TAG = "governor";
+
+/* MSC transfers come in bursts of small requests, keep full speed this long after the last one */
+#define USB_TRANSFER_HOLD_US    (200 * 1000)
+#define GOVERNOR_MIN_FREQ_MHZ   40
+
+static SemaphoreHandle_t s_mutex;
+static bool s_pm_available;
+static esp_pm_lock_handle_t s_cpu_max_lock;
+static esp_pm_lock_handle_t s_apb_max_lock;
+static esp_pm_lock_handle_t s_no_sleep_lock;
+static esp_timer_handle_t s_usb_idle_timer;
+static int64_t s_usb_last_transfer_us;
+
+static governor_config_t s_config = {
+    .run_level = GOVERNOR_LEVEL_MAX,
+    .light_sleep = false,
+};
+static uint32_t s_activities;
+/* several modules can run at once, an activity stays active until all of them end it */
+static uint32_t s_activity_count[GOVERNOR_ACTIVITY_COUNT];
+/* modules running at each level, the highest level of a running module applies */
+static uint32_t s_run_level_count[GOVERNOR_LEVEL_COUNT];
+static bool s_usb_present;
+static governor_decision_t s_decision;
+static governor_residency_t s_residency;
+
+static void update_lock(esp_pm_lock_handle_t lock, bool want, bool held)
+{
+    if (want && !held) {
+        esp_pm_lock_acquire(lock);
+    } else if (!want && held) {
+        esp_pm_lock_release(lock);
+    }
+}
+
+/* must be called with s_mutex held */
+static governor_level_t run_level(void)
+{
+    for (int level = GOVERNOR_LEVEL_COUNT - 1; level > GOVERNOR_LEVEL_LOW; --level) {
+        if (s_run_level_count[level] > 0) {
+            return (governor_level_t) level;
+        }
+    }
+    return GOVERNOR_LEVEL_LOW;
+}
+
+/* must be called with s_mutex held */
+static void apply_policy(void)
+{
+    governor_config_t config = s_config;
+    config.run_level = run_level();
+    governor_decision_t decision = governor_policy_decide(s_activities, s_usb_present, &config);
+    if (decision.level == s_decision.level && decision.allow_light_sleep == s_decision.allow_light_sleep) {
+        return;
+    }
+
+    /* acquire the new locks before releasing the old ones to avoid dipping in between */
+    if (s_pm_available) {
+        update_lock(s_cpu_max_lock, decision.level == GOVERNOR_LEVEL_MAX, s_decision.level == GOVERNOR_LEVEL_MAX);
+        update_lock(s_apb_max_lock, decision.level >= GOVERNOR_LEVEL_APB, s_decision.level >= GOVERNOR_LEVEL_APB);
+        update_lock(s_no_sleep_lock, !decision.allow_light_sleep, !s_decision.allow_light_sleep);
+    }
+    if (decision.level != s_decision.level) {
+        ESP_LOGI(TAG, "%s -> %s", governor_level_name(s_decision.level), governor_level_name(decision.level));
+    }
+    ESP_LOGD(TAG, "activities 0x%x, usb %s, run level %s: %s%s", s_activities,
+             s_usb_present ? "present" : "absent", governor_level_name(config.run_level),
+             governor_level_name(decision.level), decision.allow_light_sleep ? " (light sleep)" : "");
+    governor_residency_switch(&s_residency, decision.level, esp_timer_get_time());
+    s_decision = decision;
+}
+
+static void usb_idle_timer_cb(void* arg)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    int64_t idle_us = esp_timer_get_time() - s_usb_last_transfer_us;
+    if (idle_us < USB_TRANSFER_HOLD_US) {
+        esp_timer_start_once(s_usb_idle_timer, USB_TRANSFER_HOLD_US - idle_us);
+    } else {
+        s_activities &= ~GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_USB_TRANSFER);
+        apply_policy();
+    }
+    xSemaphoreGive(s_mutex);
+}
+
+esp_err_t governor_init(void)
+{
+    s_mutex = xSemaphoreCreateMutex();
+    if (s_mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = &usb_idle_timer_cb,
+        .name = "gov_usb_idle",
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &s_usb_idle_timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    esp_pm_config_esp32s2_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP32S2_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = GOVERNOR_MIN_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+    err = esp_pm_configure(&pm_config);
+    if (err == ESP_OK) {
+        ESP_ERROR_CHECK( esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "gov_cpu", &s_cpu_max_lock) );
+        ESP_ERROR_CHECK( esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "gov_apb", &s_apb_max_lock) );
+        ESP_ERROR_CHECK( esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "gov_sleep", &s_no_sleep_lock) );
+        s_pm_available = true;
+    } else {
+        /* decisions and residency are still tracked, the clock just doesn't change */
+        ESP_LOGW(TAG, "esp_pm_configure failed (0x%x), frequency scaling disabled", err);
+    }
+
+    /* with no locks held, power management is free to go to the lowest level */
+    s_decision.level = GOVERNOR_LEVEL_LOW;
+    s_decision.allow_light_sleep = true;
+    governor_residency_init(&s_residency, s_decision.level, esp_timer_get_time());
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    apply_policy();
+    xSemaphoreGive(s_mutex);
+    return ESP_OK;
+}
+
+void governor_configure(const governor_config_t* config)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    s_config = *config;
+    apply_policy();
+    xSemaphoreGive(s_mutex);
+    ESP_LOGI(TAG, "run level: %s, light sleep: %s", governor_level_name(config->run_level),
+             config->light_sleep ? "enabled" : "disabled");
+}
+
+/* must be called with s_mutex held */
+static void activity_begin(governor_activity_t activity)
+{
+    if (s_activity_count[activity]++ == 0) {
+        s_activities |= GOVERNOR_ACTIVITY_BIT(activity);
+    }
+}
+
+/* must be called with s_mutex held, false if the activity wasn't begun */
+static bool activity_end(governor_activity_t activity)
+{
+    if (s_activity_count[activity] == 0) {
+        return false;
+    }
+    if (--s_activity_count[activity] == 0) {
+        s_activities &= ~GOVERNOR_ACTIVITY_BIT(activity);
+    }
+    return true;
+}
+
+void governor_activity_begin(governor_activity_t activity)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    activity_begin(activity);
+    apply_policy();
+    xSemaphoreGive(s_mutex);
+}
+
+void governor_activity_end(governor_activity_t activity)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    activity_end(activity);
+    apply_policy();
+    xSemaphoreGive(s_mutex);
+}
+
+void governor_run_begin(governor_level_t level)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    activity_begin(GOVERNOR_ACTIVITY_RUN);
+    s_run_level_count[level]++;
+    apply_policy();
+    xSemaphoreGive(s_mutex);
+}
+
+void governor_run_end(governor_level_t level)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    if (s_run_level_count[level] > 0 && activity_end(GOVERNOR_ACTIVITY_RUN)) {
+        s_run_level_count[level]--;
+        apply_policy();
+    }
+    xSemaphoreGive(s_mutex);
+}
+
+void governor_usb_transfer(void)
+{
+    if (s_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    s_usb_last_transfer_us = esp_timer_get_time();
+    if (!(s_activities & GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_USB_TRANSFER))) {
+        s_activities |= GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_USB_TRANSFER);
+        apply_policy();
+        esp_timer_start_once(s_usb_idle_timer, USB_TRANSFER_HOLD_US);
+    }
+    xSemaphoreGive(s_mutex);
+}
+
+void governor_set_usb_present(bool present)
+{
+    if (s_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    s_usb_present = present;
+    apply_policy();
+    xSemaphoreGive(s_mutex);
+}
+
+void governor_log_residency(void)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    governor_residency_t residency = s_residency;
+    xSemaphoreGive(s_mutex);
+
+    int64_t now = esp_timer_get_time();
+    int64_t total = governor_residency_total(&residency, now);
+    if (total <= 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "residency over %d ms, %d transitions: low %d%%, apb %d%%, max %d%%",
+             (int) (total / 1000), residency.transitions,
+             (int) (governor_residency_time(&residency, GOVERNOR_LEVEL_LOW, now) * 100 / total),
+             (int) (governor_residency_time(&residency, GOVERNOR_LEVEL_APB, now) * 100 / total),
+             (int) (governor_residency_time(&residency, GOVERNOR_LEVEL_MAX, now) * 100 / total));
+}
@@ -0,0 +1,94 @@
+#include <string.h>
+#include "governor_policy.h"
+
+static governor_level_t level_max(governor_level_t a, governor_level_t b)
+{
+    return (a > b) ? a : b;
+}
+
+governor_decision_t governor_policy_decide(uint32_t activities, bool usb_present, const governor_config_t* config)
+{
+    governor_level_t level = GOVERNOR_LEVEL_LOW;
+
+    if (activities & (GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_LOAD) |
+                      GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_USB_TRANSFER))) {
+        level = GOVERNOR_LEVEL_MAX;
+    }
+    if (activities & GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_RUN)) {
+        level = level_max(level, config->run_level);
+    }
+    if (activities & (GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_FS) |
+                      GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_COMMIT))) {
+        level = level_max(level, GOVERNOR_LEVEL_APB);
+    }
+    /* Keep the bus clock up whenever a host may enumerate the device, not just once
+     * it has: at the low level the USB PLL may be off, and enumeration fails.
+     */
+    if (usb_present) {
+        level = level_max(level, GOVERNOR_LEVEL_APB);
+    }
+
+    governor_decision_t decision = {
+        .level = level,
+        .allow_light_sleep = (level == GOVERNOR_LEVEL_LOW && config->light_sleep),
+    };
+    return decision;
+}
+
+void governor_residency_init(governor_residency_t* residency, governor_level_t level, int64_t now_us)
+{
+    memset(residency, 0, sizeof(*residency));
+    residency->level = level;
+    residency->since_us = now_us;
+}
+
+void governor_residency_switch(governor_residency_t* residency, governor_level_t level, int64_t now_us)
+{
+    if (level == residency->level) {
+        return;
+    }
+    residency->time_us[residency->level] += now_us - residency->since_us;
+    residency->level = level;
+    residency->since_us = now_us;
+    residency->transitions++;
+}
+
+int64_t governor_residency_time(const governor_residency_t* residency, governor_level_t level, int64_t now_us)
+{
+    int64_t time_us = residency->time_us[level];
+    if (level == residency->level) {
+        time_us += now_us - residency->since_us;
+    }
+    return time_us;
+}
+
+int64_t governor_residency_total(const governor_residency_t* residency, int64_t now_us)
+{
+    int64_t total = 0;
+    for (int i = 0; i < GOVERNOR_LEVEL_COUNT; ++i) {
+        total += governor_residency_time(residency, (governor_level_t) i, now_us);
+    }
+    return total;
+}
+
+static const char* const s_level_names[GOVERNOR_LEVEL_COUNT] = {
+    [GOVERNOR_LEVEL_LOW] = "low",
+    [GOVERNOR_LEVEL_APB] = "apb",
+    [GOVERNOR_LEVEL_MAX] = "max",
+};
+
+const char* governor_level_name(governor_level_t level)
+{
+    return (level < GOVERNOR_LEVEL_COUNT) ? s_level_names[level] : "?";
+}
+
+bool governor_level_from_name(const char* name, governor_level_t* out_level)
+{
+    for (int i = 0; i < GOVERNOR_LEVEL_COUNT; ++i) {
+        if (strcmp(name, s_level_names[i]) == 0) {
+            *out_level = (governor_level_t) i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+/* Power governor policy. This header and governor_policy.c don't depend on
+ * ESP-IDF, so the policy can be built and exercised on a Linux host.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    GOVERNOR_LEVEL_LOW,     /* minimum CPU frequency, light sleep allowed if enabled */
+    GOVERNOR_LEVEL_APB,     /* CPU at 80 MHz, APB at full speed */
+    GOVERNOR_LEVEL_MAX,     /* maximum CPU frequency */
+    GOVERNOR_LEVEL_COUNT
+} governor_level_t;
+
+typedef enum {
+    GOVERNOR_ACTIVITY_FS,           /* mounting, unmounting, firmware file access */
+    GOVERNOR_ACTIVITY_LOAD,         /* reading, parsing and compiling a module */
+    GOVERNOR_ACTIVITY_RUN,          /* guest code executing */
+    GOVERNOR_ACTIVITY_USB_TRANSFER, /* MSC reads and writes in progress */
+    GOVERNOR_ACTIVITY_COMMIT,       /* writing the staging disk back to flash */
+    GOVERNOR_ACTIVITY_COUNT
+} governor_activity_t;
+
+#define GOVERNOR_ACTIVITY_BIT(activity) (1u << (activity))
+
+typedef struct {
+    governor_level_t run_level;     /* level while guest code runs */
+    bool light_sleep;               /* allow light sleep when nothing is active */
+} governor_config_t;
+
+typedef struct {
+    governor_level_t level;
+    bool allow_light_sleep;
+} governor_decision_t;
+
+typedef struct {
+    governor_level_t level;
+    int64_t since_us;
+    int64_t time_us[GOVERNOR_LEVEL_COUNT];
+    uint32_t transitions;
+} governor_residency_t;
+
+/* usb_present: the USB PHY is enabled and VBUS is present (or can't be sensed) */
+governor_decision_t governor_policy_decide(uint32_t activities, bool usb_present, const governor_config_t* config);
+
+void governor_residency_init(governor_residency_t* residency, governor_level_t level, int64_t now_us);
+void governor_residency_switch(governor_residency_t* residency, governor_level_t level, int64_t now_us);
+int64_t governor_residency_total(const governor_residency_t* residency, int64_t now_us);
+int64_t governor_residency_time(const governor_residency_t* residency, governor_level_t level, int64_t now_us);
+
+const char* governor_level_name(governor_level_t level);
+bool governor_level_from_name(const char* name, governor_level_t* out_level);
+
+#ifdef __cplusplus
+}
+#endif
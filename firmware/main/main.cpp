@@ -1,15 +1,21 @@
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
+#include <cassert>
 #include <cstring>
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/dirent.h>
 #include "esp_log.h"
 #include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/event_groups.h"
 #include "common.h"
 
 static const char* TAG = "main";
@@ -25,29 +31,67 @@ static void set_running_flag(void);
 static void clear_running_flag(void);
 static bool is_running_flag_set(void);
 static TaskHandle_t s_main_task_handle;
+static int64_t s_eject_time_us;
+static void init_nvs(void);
+static void dump_trace(void);
+static void usb_init_task(void* arg);
+static void storage_init_task(void* arg);
+static void readme_task(void* arg);
+
+/* startup steps running in their own tasks */
+static EventGroupHandle_t s_boot_events;
+#define BOOT_STORAGE_READY  (1 << 0)
+#define BOOT_README_DONE    (1 << 1)
+
+/* WL mount, journal replay, f_mkfs and f_mount used to run on the 32 kB main task
+ * stack. Not measured on a board yet: the size is an estimate, about 3.5 kB on the
+ * format path (ESP_LOG formatting and the FATFS -> WL -> SPI flash write chain; the
+ * f_mkfs work buffer is on the heap), doubled. storage_init_task logs the high water
+ * mark for the format and the mount path, and warns when less than a quarter is
+ * left. The task is deleted once storage is up, so the margin only costs RAM
+ * during boot.
+ */
+#define STORAGE_INIT_STACK_SIZE (8 * 1024)
 
 
 extern "C" void app_main(void)
 {
     s_main_task_handle = xTaskGetCurrentTaskHandle();
     heap_caps_register_failed_alloc_callback(&alloc_failed_hook);
+    ESP_ERROR_CHECK( governor_init() );
+    ESP_ERROR_CHECK( events_init() );
+    ESP_ERROR_CHECK( channels_init() );
+    ESP_ERROR_CHECK( assets_init() );
+    governor_activity_begin(GOVERNOR_ACTIVITY_FS);
     status_init();
     status_red();
+    s_boot_events = xEventGroupCreate();
+    assert(s_boot_events != NULL);
 
+    /* USB enumeration and mounting the filesystem overlap with NVS init */
     ESP_LOGI(TAG, "Initializing USB...");
     msc_allow_mount(false);
-    usb_init();
-
+    xTaskCreate(usb_init_task, "usb_init", 4 * 1024, NULL, 1, NULL);
     ESP_LOGI(TAG, "Initializing filesystem...");
-    ESP_ERROR_CHECK( storage_init_wl() );
-    ESP_ERROR_CHECK( storage_mount_fat(BASE_PATH) );
+    xTaskCreate(storage_init_task, "storage_init", STORAGE_INIT_STACK_SIZE, NULL, 1, NULL);
+
+    init_nvs();
+    stack_profile_init();
+    xEventGroupWaitBits(s_boot_events, BOOT_STORAGE_READY, pdFALSE, pdTRUE, portMAX_DELAY);
     status_green();
 
-    create_readme_file();
+    /* README.MD isn't needed to run a module, it is created at idle priority
+     * while the module starts, and the filesystem stays mounted until it's done
+     */
+    xTaskCreate(readme_task, "readme", 3 * 1024, NULL, tskIDLE_PRIORITY, NULL);
     ESP_LOGI(TAG, "Loading settings...");
     ESP_ERROR_CHECK( settings_load(BASE_PATH "/settings.txt", &s_settings) );
+    governor_configure(&s_settings.governor);
+    ESP_LOGI(TAG, "Startup done after %d ms", (int) (esp_timer_get_time() / 1000));
 
     while (true) {
+        dump_trace();
+        assets_import(BASE_PATH "/ASSETS.BIN");
         if (is_running_flag_set()) {
             ESP_LOGI(TAG, "WASM didn't finish last time, skipping...");
             clear_running_flag();
@@ -58,27 +102,98 @@ extern "C" void app_main(void)
             clear_running_flag();
         }
 
+        xEventGroupWaitBits(s_boot_events, BOOT_README_DONE, pdFALSE, pdTRUE, portMAX_DELAY);
         ESP_LOGI(TAG, "Unmounting filesystem...");
         ESP_ERROR_CHECK( storage_unmount_fat() );
+        if (s_settings.msc_staging && !staging_active()) {
+            ESP_LOGI(TAG, "Enabling staging disk...");
+            if (staging_enable() != ESP_OK) {
+                ESP_LOGW(TAG, "Staging disk not available, using flash directly");
+            }
+        }
+        governor_activity_end(GOVERNOR_ACTIVITY_FS);
 
         status_blue();
         ESP_LOGI(TAG, "Waiting for USB...");
         msc_allow_mount(true);
         uint32_t notify_val = 0;
         xTaskNotifyWait(0, 1, &notify_val, portMAX_DELAY);
+        governor_log_residency();
+        storage_cache_log_stats();
 
         status_green();
+        governor_activity_begin(GOVERNOR_ACTIVITY_FS);
         ESP_LOGI(TAG, "Mounting filesystem...");
         ESP_ERROR_CHECK( storage_mount_fat(BASE_PATH) );
+        staging_commit();
     }
 }
 
 void msc_on_eject(void)
 {
     ESP_LOGI(TAG, "USB eject callback called");
+    s_eject_time_us = esp_timer_get_time();
     xTaskNotifyGive(s_main_task_handle);
 }
 
+static void usb_init_task(void* arg)
+{
+    usb_init();
+    TRACE_THREAD_EXIT();
+    vTaskDelete(NULL);
+}
+
+static void storage_init_task(void* arg)
+{
+    ESP_ERROR_CHECK( storage_init_wl() );
+    ESP_ERROR_CHECK( storage_mount_fat(BASE_PATH) );
+    /* on ESP-IDF the high water mark is in bytes */
+    int unused = (int) uxTaskGetStackHighWaterMark(NULL);
+    const char* path = storage_fat_formatted() ? "format" : "mount";
+    if (unused < STORAGE_INIT_STACK_SIZE / 4) {
+        ESP_LOGW(TAG, "storage_init (%s) used %d of %d bytes of stack, raise STORAGE_INIT_STACK_SIZE",
+                 path, STORAGE_INIT_STACK_SIZE - unused, STORAGE_INIT_STACK_SIZE);
+    } else {
+        ESP_LOGI(TAG, "storage_init (%s) used %d of %d bytes of stack",
+                 path, STORAGE_INIT_STACK_SIZE - unused, STORAGE_INIT_STACK_SIZE);
+    }
+    xEventGroupSetBits(s_boot_events, BOOT_STORAGE_READY);
+    TRACE_THREAD_EXIT();
+    vTaskDelete(NULL);
+}
+
+static void readme_task(void* arg)
+{
+    create_readme_file();
+    xEventGroupSetBits(s_boot_events, BOOT_README_DONE);
+    TRACE_THREAD_EXIT();
+    vTaskDelete(NULL);
+}
+
+static void init_nvs(void)
+{
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "NVS partition is full or outdated, erasing");
+        ESP_ERROR_CHECK( nvs_flash_erase() );
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK( err );
+}
+
+/* writes the events recorded since the drive was last mounted, see trace.h */
+static void dump_trace(void)
+{
+#if CONFIG_WASM_DEMO_TRACE
+    int count = trace_dump(BASE_PATH "/trace.json");
+    if (count < 0) {
+        ESP_LOGW(TAG, "Failed to write trace");
+    } else {
+        ESP_LOGI(TAG, "Wrote %d trace events to " BASE_PATH "/trace.json", count);
+    }
+#endif
+}
+
 static void create_readme_file(void)
 {
     const char* readme_txt_name = BASE_PATH "/README.MD";
@@ -95,23 +210,75 @@ static void create_readme_file(void)
     }
 }
 
+static void log_eject_to_run(void)
+{
+    if (s_eject_time_us != 0) {
+        ESP_LOGI(TAG, "Eject to run: %d ms", (int) ((esp_timer_get_time() - s_eject_time_us) / 1000));
+        s_eject_time_us = 0;
+    }
+}
+
+/* Starts every module listed in run_modules, they run at the same time and can
+ * talk through channels. Each one has its own run level.
+ */
+static void run_listed_wasm(const char* list)
+{
+    char names[sizeof(s_settings.run_modules)];
+    strlcpy(names, list, sizeof(names));
+    std::vector<std::string> wasm_files;
+    std::vector<governor_level_t> run_levels;
+    char* saveptr = NULL;
+    for (char* name = strtok_r(names, ", ", &saveptr); name != NULL; name = strtok_r(NULL, ", ", &saveptr)) {
+        std::string wasm_file = std::string(BASE_PATH "/") + name;
+        struct stat st;
+        if (stat(wasm_file.c_str(), &st) != 0) {
+            ESP_LOGW(TAG, "%s not found", wasm_file.c_str());
+            continue;
+        }
+        ESP_LOGI(TAG, "Running %s", wasm_file.c_str());
+        wasm_files.push_back(wasm_file);
+        run_levels.push_back(settings_get_run_level(&s_settings, name));
+    }
+    if (wasm_files.empty()) {
+        ESP_LOGW(TAG, "Nothing to execute");
+        return;
+    }
+    std::vector<const char*> wasm_file_names;
+    for (const std::string& wasm_file : wasm_files) {
+        wasm_file_names.push_back(wasm_file.c_str());
+    }
+    log_eject_to_run();
+    wasm_run(wasm_file_names.data(), run_levels.data(), wasm_file_names.size(),
+             s_settings.wasm_task_stack_size, s_settings.wasm_env_stack_size);
+}
+
 static void run_latest_wasm(void)
 {
+    if (s_settings.run_modules[0] != 0) {
+        run_listed_wasm(s_settings.run_modules);
+        return;
+    }
     std::string wasm_file = get_latest_wasm_file();
     if (!wasm_file.size()) {
         ESP_LOGW(TAG, "Nothing to execute");
         return;
     }
     ESP_LOGI(TAG, "Running %s", wasm_file.c_str());
-    wasm_run(wasm_file.c_str(), s_settings.wasm_task_stack_size, s_settings.wasm_env_stack_size);
+    const char* module_name = wasm_file.c_str() + strlen(BASE_PATH "/");
+    governor_level_t run_level = settings_get_run_level(&s_settings, module_name);
+    log_eject_to_run();
+    const char* wasm_file_name = wasm_file.c_str();
+    wasm_run(&wasm_file_name, &run_level, 1, s_settings.wasm_task_stack_size, s_settings.wasm_env_stack_size);
 }
 
 
+/* The listing only looks at the first bytes of each file. Compressed candidates
+ * are decompressed up to the module header, newest first, until one is a module.
+ */
 std::string get_latest_wasm_file(void)
 {
     ESP_LOGI(TAG, "Files list:");
-    time_t latest_mtime = 0;
-    std::string latest_mtime_file;
+    std::vector<std::pair<time_t, std::string>> candidates;
     DIR* dir = opendir(BASE_PATH);
     while (true) {
         struct dirent* de = readdir(dir);
@@ -126,26 +293,32 @@ std::string get_latest_wasm_file(void)
         time_t mtime = st.st_mtime;
         struct tm mtm;
         localtime_r(&mtime, &mtm);
-        bool is_wasm = false;
-        FILE* f = fopen(full_name, "rb");
-        if (f) {
-            char hdr[4];
-            const char hdr_expected[] = {0x00, 0x61, 0x73, 0x6d};
-            if (fread(hdr, 1, 4, f) == 4 && memcmp(hdr, hdr_expected, 4) == 0) {
-                is_wasm = true;
-            }
-            fclose(f);
+        wasm_format_t format = wasm_file_format(full_name);
+        bool is_wasm = (format != WASM_FORMAT_UNKNOWN);
+        char wasm_tag[16] = "";
+        if (format == WASM_FORMAT_PLAIN) {
+            strcpy(wasm_tag, " [WASM]");
+        } else if (is_wasm) {
+            snprintf(wasm_tag, sizeof(wasm_tag), " [WASM, %s]", wasm_format_name(format));
         }
         char* str_time = asctime(&mtm);
         str_time[strlen(str_time) - 1] = 0;
-        ESP_LOGI(TAG, "File: %s mtime: %s%s", full_name, str_time, is_wasm?" [WASM]":"");
-        if (is_wasm && mtime > latest_mtime) {
-            latest_mtime = mtime;
-            latest_mtime_file = full_name;
+        ESP_LOGI(TAG, "File: %s mtime: %s%s", full_name, str_time, wasm_tag);
+        if (is_wasm && mtime > 0) {
+            candidates.emplace_back(mtime, full_name);
         }
     }
     closedir(dir);
-    return latest_mtime_file;
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const std::pair<time_t, std::string>& a, const std::pair<time_t, std::string>& b) {
+                         return a.first > b.first;
+                     });
+    for (const auto& candidate : candidates) {
+        if (wasm_probe_file(candidate.second.c_str()) != WASM_FORMAT_UNKNOWN) {
+            return candidate.second;
+        }
+    }
+    return std::string();
 }
 
 static void alloc_failed_hook(size_t size, uint32_t caps, const char * function_name)
@@ -92,6 +92,7 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
             ESP_LOGI(TAG, "MSC START");
         } else {
             ESP_LOGI(TAG, "MSC EJECT");
+            TRACE_INSTANT("msc_eject", "lun", lun);
             s_allow_mount = false;
             msc_on_eject();
         }
@@ -104,8 +105,11 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buff
 {
     ESP_LOGD(TAG, "tud_msc_read10_cb() invoked, lun=%d, lba=%d, offset=%d, bufsize=%d", lun, lba, offset, bufsize);
 
+    governor_usb_transfer();
     size_t addr = lba * storage_get_sector_size() + offset;
+    TRACE_BEGIN_ARGS("msc_read10", "lba", lba, "size", bufsize);
     esp_err_t err = storage_read_sector(addr, bufsize, buffer);
+    TRACE_END("msc_read10");
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "storage_read_sector failed: 0x%x", err);
         return 0;
@@ -117,8 +121,11 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *
 {
     ESP_LOGD(TAG, "tud_msc_write10_cb() invoked, lun=%d, lba=%d, offset=%d", lun, lba, offset);
 
+    governor_usb_transfer();
     size_t addr = lba * storage_get_sector_size() + offset;
+    TRACE_BEGIN_ARGS("msc_write10", "lba", lba, "size", bufsize);
     esp_err_t err = storage_write_sector(addr, bufsize, buffer);
+    TRACE_END("msc_write10");
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "storage_write_sector failed: 0x%x", err);
         return 0;
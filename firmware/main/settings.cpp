@@ -1,23 +1,58 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "nvs.h"
 #include "common.h"
 
+static const char* TAG = "settings";
+
+/* Parsed settings are cached in NVS together with the size and mtime of
+ * settings.txt, so the file is only parsed again after it has been changed.
+ */
+#define NVS_NAMESPACE           "settings"
+#define NVS_KEY_CACHE           "cache"
+#define SETTINGS_CACHE_VERSION  2
+
+typedef struct {
+    uint32_t version;
+    uint32_t file_size;
+    int64_t file_mtime;
+    wasm_example_settings_t settings;
+} settings_cache_t;
+
 static void handle_settings_line(wasm_example_settings_t* settings, const char* first, const char* second);
 static void create_default_settings_file(const char* filename, const wasm_example_settings_t* settings);
+static bool load_cached_settings(const struct stat* st, wasm_example_settings_t* out_settings);
+static void store_cached_settings(const struct stat* st, const wasm_example_settings_t* settings);
 
 esp_err_t settings_load(const char* filename, wasm_example_settings_t* out_settings)
 {
+    struct stat st;
+    if (stat(filename, &st) == 0 && load_cached_settings(&st, out_settings)) {
+        ESP_LOGI(TAG, "settings.txt unchanged, using cached settings");
+        return ESP_OK;
+    }
+
     *out_settings = {};
     out_settings->wasm_task_stack_size = 32 * 1024;
     out_settings->wasm_env_stack_size = 8 * 1024;
+    out_settings->governor.run_level = GOVERNOR_LEVEL_MAX;
+    out_settings->governor.light_sleep = false;
 
     FILE* f = fopen(filename, "r");
     if (f == NULL) {
         create_default_settings_file(filename, out_settings);
+        if (stat(filename, &st) == 0) {
+            store_cached_settings(&st, out_settings);
+        }
         return ESP_OK;
     }
 
-    char line[100];
+    char line[128];
     while (fgets(line, sizeof(line), f) != NULL) {
         if (line[0] == '#') {
             continue;
@@ -27,21 +62,101 @@ esp_err_t settings_load(const char* filename, wasm_example_settings_t* out_setti
             continue;
         }
         *eq_pos = 0;
+        char* second = eq_pos + 1;
+        size_t len = strlen(second);
+        while (len > 0 && isspace((unsigned char) second[len - 1])) {
+            second[--len] = 0;
+        }
         const char* first = line;
-        const char* second = eq_pos + 1;
         handle_settings_line(out_settings, first, second);
     }
     fclose(f);
+    if (stat(filename, &st) == 0) {
+        store_cached_settings(&st, out_settings);
+    }
     return ESP_OK;
 }
 
+static bool load_cached_settings(const struct stat* st, wasm_example_settings_t* out_settings)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    settings_cache_t cache;
+    size_t size = sizeof(cache);
+    esp_err_t err = nvs_get_blob(nvs, NVS_KEY_CACHE, &cache, &size);
+    nvs_close(nvs);
+    if (err != ESP_OK || size != sizeof(cache) || cache.version != SETTINGS_CACHE_VERSION ||
+            cache.file_size != (uint32_t) st->st_size || cache.file_mtime != (int64_t) st->st_mtime) {
+        return false;
+    }
+    *out_settings = cache.settings;
+    return true;
+}
+
+static void store_cached_settings(const struct stat* st, const wasm_example_settings_t* settings)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    settings_cache_t cache = {};
+    cache.version = SETTINGS_CACHE_VERSION;
+    cache.file_size = (uint32_t) st->st_size;
+    cache.file_mtime = (int64_t) st->st_mtime;
+    cache.settings = *settings;
+    nvs_set_blob(nvs, NVS_KEY_CACHE, &cache, sizeof(cache));
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
 static void handle_settings_line(wasm_example_settings_t* settings, const char* first, const char* second)
 {
     if (strcmp(first, "wasm_task_stack_size") == 0) {
         settings->wasm_task_stack_size = (size_t) strtol(second, NULL, 0);
     } else if (strcmp(first, "wasm_env_stack_size") == 0) {
         settings->wasm_env_stack_size = (size_t) strtol(second, NULL, 0);
+    } else if (strcmp(first, "msc_staging") == 0) {
+        settings->msc_staging = strtol(second, NULL, 0) != 0;
+    } else if (strcmp(first, "pm_light_sleep") == 0) {
+        settings->governor.light_sleep = strtol(second, NULL, 0) != 0;
+    } else if (strcmp(first, "run_modules") == 0) {
+        if (strlen(second) >= sizeof(settings->run_modules)) {
+            ESP_LOGW(TAG, "run_modules is too long, ignoring it");
+            return;
+        }
+        strcpy(settings->run_modules, second);
+    } else if (strcmp(first, "pm_run_level") == 0) {
+        if (!governor_level_from_name(second, &settings->governor.run_level)) {
+            ESP_LOGW(TAG, "unknown pm_run_level: %s", second);
+        }
+    } else if (strncmp(first, "pm_run_level.", strlen("pm_run_level.")) == 0) {
+        /* per-module override, e.g. pm_run_level.hello.wasm=apb */
+        const char* module_name = first + strlen("pm_run_level.");
+        governor_level_t level;
+        if (!governor_level_from_name(second, &level)) {
+            ESP_LOGW(TAG, "unknown pm_run_level for %s: %s", module_name, second);
+            return;
+        }
+        if (settings->module_count == SETTINGS_MAX_MODULE_OVERRIDES) {
+            ESP_LOGW(TAG, "too many module overrides, ignoring %s", module_name);
+            return;
+        }
+        wasm_module_settings_t* module = &settings->modules[settings->module_count++];
+        strlcpy(module->module_name, module_name, sizeof(module->module_name));
+        module->pm_run_level = level;
+    }
+}
+
+governor_level_t settings_get_run_level(const wasm_example_settings_t* settings, const char* module_name)
+{
+    for (size_t i = 0; i < settings->module_count; ++i) {
+        if (strcasecmp(settings->modules[i].module_name, module_name) == 0) {
+            return settings->modules[i].pm_run_level;
+        }
     }
+    return settings->governor.run_level;
 }
 
 static void create_default_settings_file(const char* filename, const wasm_example_settings_t* settings)
@@ -49,5 +164,14 @@ static void create_default_settings_file(const char* filename, const wasm_exampl
     FILE* f = fopen(filename, "w");
     fprintf(f, "# stack size for wasm task\nwasm_task_stack_size=%d\n", settings->wasm_task_stack_size);
     fprintf(f, "# wasm interpreter stack size\nwasm_env_stack_size=%d\n", settings->wasm_env_stack_size);
+    fprintf(f, "# CPU level while a module runs: max, apb or low\n"
+               "# can be set per module, e.g. pm_run_level.hello.wasm=apb\npm_run_level=%s\n",
+            governor_level_name(settings->governor.run_level));
+    fprintf(f, "# allow light sleep when idle and USB is disconnected\npm_light_sleep=%d\n",
+            settings->governor.light_sleep ? 1 : 0);
+    fprintf(f, "# keep the drive in PSRAM while USB is connected, write it to flash after eject\nmsc_staging=%d\n",
+            settings->msc_staging ? 1 : 0);
+    fprintf(f, "# run these modules at the same time instead of the latest file\n"
+               "#run_modules=acquire.wasm,filter.wasm\n");
     fclose(f);
 }
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "common.h"
+
+static const char* TAG = "stack_profile";
+
+#define NVS_NAMESPACE       "stack_prof"
+#define NVS_KEY_RUNNING     "running"
+
+/* extra room on top of the measured usage */
+#define TASK_STACK_MARGIN   1024
+#define ENV_STACK_MARGIN    512
+#define TASK_STACK_MIN      (6 * 1024)
+#define ENV_STACK_MIN       1024
+#define STACK_ALIGN         256
+
+static void profile_key(uint32_t module_hash, char* key)
+{
+    snprintf(key, 16, "%08x", module_hash);
+}
+
+static size_t adapt_size(size_t used, size_t margin, size_t min, size_t cap)
+{
+    size_t size = used + used / 4 + margin;
+    size = (size + STACK_ALIGN - 1) & ~(STACK_ALIGN - 1);
+    return MIN(MAX(size, min), cap);
+}
+
+void stack_profile_init(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    /* the last run didn't finish, don't trust the sizes it was given */
+    uint32_t running_hash;
+    if (nvs_get_u32(nvs, NVS_KEY_RUNNING, &running_hash) == ESP_OK) {
+        char key[16];
+        profile_key(running_hash, key);
+        ESP_LOGW(TAG, "module %s didn't finish last time, using configured stack sizes for it", key);
+        nvs_erase_key(nvs, key);
+        nvs_erase_key(nvs, NVS_KEY_RUNNING);
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+void stack_profile_apply(uint32_t module_hash, size_t* task_stack_size, size_t* env_stack_size)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    char key[16];
+    profile_key(module_hash, key);
+    stack_profile_t profile;
+    size_t size = sizeof(profile);
+    esp_err_t err = nvs_get_blob(nvs, key, &profile, &size);
+    if (err == ESP_OK && size == sizeof(profile)) {
+        /* settings.txt values stay the upper limit */
+        size_t task_cap = *task_stack_size;
+        size_t env_cap = *env_stack_size;
+        *task_stack_size = adapt_size(profile.task_stack_used, TASK_STACK_MARGIN, TASK_STACK_MIN, task_cap);
+        *env_stack_size = adapt_size(profile.env_stack_used, ENV_STACK_MARGIN, ENV_STACK_MIN, env_cap);
+        ESP_LOGI(TAG, "module %s: task stack %d (used %d, cap %d), wasm stack %d (used %d, cap %d), %d bytes saved",
+                 key, *task_stack_size, profile.task_stack_used, task_cap,
+                 *env_stack_size, profile.env_stack_used, env_cap,
+                 (task_cap - *task_stack_size) + (env_cap - *env_stack_size));
+    } else {
+        ESP_LOGI(TAG, "module %s: no stack profile yet, using configured sizes", key);
+    }
+    nvs_set_u32(nvs, NVS_KEY_RUNNING, module_hash);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+void stack_profile_update(uint32_t module_hash, const stack_profile_t* measured, stack_profile_result_t result)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    char key[16];
+    profile_key(module_hash, key);
+    if (result == STACK_PROFILE_OVERFLOW) {
+        ESP_LOGW(TAG, "module %s ran out of stack, dropping its profile", key);
+        nvs_erase_key(nvs, key);
+    } else if (result == STACK_PROFILE_FAILED) {
+        /* a module which fails early, or traps, didn't reach its deepest calls */
+        ESP_LOGI(TAG, "module %s didn't complete, keeping its profile", key);
+    } else {
+        stack_profile_t profile = *measured;
+        stack_profile_t stored;
+        size_t size = sizeof(stored);
+        if (nvs_get_blob(nvs, key, &stored, &size) == ESP_OK && size == sizeof(stored)) {
+            /* keep the deepest usage seen so far, runs may take different paths */
+            profile.task_stack_used = MAX(profile.task_stack_used, stored.task_stack_used);
+            profile.env_stack_used = MAX(profile.env_stack_used, stored.env_stack_used);
+        }
+        ESP_LOGI(TAG, "module %s: task stack used %d, wasm stack used %d",
+                 key, measured->task_stack_used, measured->env_stack_used);
+        nvs_set_blob(nvs, key, &profile, sizeof(profile));
+    }
+    nvs_erase_key(nvs, NVS_KEY_RUNNING);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
@@ -0,0 +1,478 @@
+// Staging RAM disk.
+// When enabled, the whole FAT volume is mirrored in PSRAM. MSC and the firmware
+// FATFS driver both read and write the RAM copy, so uploads run at USB speed and
+// a module can be loaded as soon as the drive is ejected. Dirty sectors are
+// written back to the flash volume by a background task.
+//
+// Commit order: data sectors first, then the FAT metadata region (boot sector,
+// FATs, root directory). Metadata sectors are first written to the "journal"
+// partition as one record, whose header is written last. If a reset happens
+// while the metadata is being applied, storage_init_wl() replays the journal,
+// so the boot sector, FATs and root directory are always either all old or all
+// new.
+//
+// Only that region is journaled. Subdirectory entries live in data clusters,
+// which are written directly and before the metadata, and are snapshotted in a
+// different pass than the metadata. A reset during commit_data() can therefore
+// leave a subdirectory partly updated, or pointing at clusters the old FAT
+// doesn't allocate yet; files in the root directory are not affected.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp32s2/rom/crc.h"
+#include "diskio_impl.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "common.h"
+
+static const char* TAG = "staging";
+
+#define JOURNAL_PARTITION_SUBTYPE   0x40
+#define JOURNAL_MAGIC               0x4a545453  /* "STTJ" */
+#define JOURNAL_MAX_SECTORS         256
+#define JOURNAL_DATA_OFFSET         SPI_FLASH_SEC_SIZE
+/* contiguous dirty data sectors are written back in chunks of this size */
+#define COMMIT_CHUNK_SIZE           4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sector_size;
+    uint32_t count;
+    uint32_t crc;           /* over sectors[0..count) and the sector data */
+    uint32_t sectors[JOURNAL_MAX_SECTORS];
+} journal_header_t;
+
+static bool s_active;
+static uint8_t* s_image;
+static size_t s_sector_size;
+static size_t s_sector_count;
+static uint32_t* s_dirty;
+static SemaphoreHandle_t s_mutex;
+static TaskHandle_t s_commit_task;
+static const esp_partition_t* s_journal;
+static journal_header_t s_journal_header;
+
+static bool is_dirty(size_t sector)
+{
+    return (s_dirty[sector / 32] & (1u << (sector % 32))) != 0;
+}
+
+static void set_dirty(size_t sector, bool dirty)
+{
+    if (dirty) {
+        s_dirty[sector / 32] |= (1u << (sector % 32));
+    } else {
+        s_dirty[sector / 32] &= ~(1u << (sector % 32));
+    }
+}
+
+static size_t count_dirty(size_t first, size_t last)
+{
+    size_t count = 0;
+    for (size_t i = first; i < last; ++i) {
+        count += is_dirty(i) ? 1 : 0;
+    }
+    return count;
+}
+
+static const esp_partition_t* find_journal(void)
+{
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, JOURNAL_PARTITION_SUBTYPE, NULL);
+}
+
+static size_t journal_capacity(void)
+{
+    if (s_journal == NULL || s_journal->size <= JOURNAL_DATA_OFFSET) {
+        return 0;
+    }
+    return MIN(JOURNAL_MAX_SECTORS, (s_journal->size - JOURNAL_DATA_OFFSET) / s_sector_size);
+}
+
+static esp_err_t journal_write(const uint8_t* data, size_t count)
+{
+    size_t data_size = count * s_sector_size;
+    size_t erase_size = JOURNAL_DATA_OFFSET + ((data_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1));
+    esp_err_t err = esp_partition_erase_range(s_journal, 0, erase_size);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = esp_partition_write(s_journal, JOURNAL_DATA_OFFSET, data, data_size);
+    if (err != ESP_OK) {
+        return err;
+    }
+    s_journal_header.magic = JOURNAL_MAGIC;
+    s_journal_header.sector_size = s_sector_size;
+    s_journal_header.count = count;
+    uint32_t crc = crc32_le(0, (const uint8_t*) s_journal_header.sectors, count * sizeof(uint32_t));
+    s_journal_header.crc = crc32_le(crc, data, data_size);
+    /* the record becomes valid once the header is written */
+    return esp_partition_write(s_journal, 0, &s_journal_header, sizeof(s_journal_header));
+}
+
+static esp_err_t journal_clear(void)
+{
+    return esp_partition_erase_range(s_journal, 0, SPI_FLASH_SEC_SIZE);
+}
+
+esp_err_t staging_recover(void)
+{
+    s_journal = find_journal();
+    if (s_journal == NULL) {
+        return ESP_OK;
+    }
+    esp_err_t err = esp_partition_read(s_journal, 0, &s_journal_header, sizeof(s_journal_header));
+    if (err != ESP_OK) {
+        return err;
+    }
+    journal_header_t* hdr = &s_journal_header;
+    if (hdr->magic != JOURNAL_MAGIC) {
+        return ESP_OK;
+    }
+    if (hdr->sector_size != storage_get_sector_size() || hdr->count > JOURNAL_MAX_SECTORS ||
+            JOURNAL_DATA_OFFSET + hdr->count * hdr->sector_size > s_journal->size) {
+        ESP_LOGW(TAG, "discarding invalid journal");
+        return journal_clear();
+    }
+
+    size_t data_size = hdr->count * hdr->sector_size;
+    uint8_t* data = heap_caps_malloc(data_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (data == NULL) {
+        data = malloc(data_size);
+    }
+    if (data == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    err = esp_partition_read(s_journal, JOURNAL_DATA_OFFSET, data, data_size);
+    if (err == ESP_OK) {
+        uint32_t crc = crc32_le(0, (const uint8_t*) hdr->sectors, hdr->count * sizeof(uint32_t));
+        crc = crc32_le(crc, data, data_size);
+        if (crc != hdr->crc) {
+            ESP_LOGW(TAG, "journal record incomplete, keeping previous metadata");
+        } else {
+            ESP_LOGW(TAG, "replaying %d metadata sectors from interrupted commit", hdr->count);
+            for (size_t i = 0; i < hdr->count && err == ESP_OK; ++i) {
+                err = storage_flash_write(hdr->sectors[i] * hdr->sector_size, hdr->sector_size,
+                                          data + i * hdr->sector_size);
+            }
+        }
+    }
+    free(data);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return journal_clear();
+}
+
+/* Writes back dirty sectors in [first, last), contiguous ones in chunks */
+static esp_err_t commit_data(size_t first, size_t last, uint8_t* buf, size_t* done, size_t total)
+{
+    const size_t chunk_sectors = COMMIT_CHUNK_SIZE / s_sector_size;
+    size_t next_report = total / 4;
+    size_t sector = first;
+    while (sector < last) {
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        while (sector < last && !is_dirty(sector)) {
+            sector++;
+        }
+        size_t run = 0;
+        while (sector + run < last && run < chunk_sectors && is_dirty(sector + run)) {
+            set_dirty(sector + run, false);
+            run++;
+        }
+        memcpy(buf, s_image + sector * s_sector_size, run * s_sector_size);
+        xSemaphoreGive(s_mutex);
+        if (run == 0) {
+            break;
+        }
+
+        esp_err_t err = storage_flash_write(sector * s_sector_size, run * s_sector_size, buf);
+        if (err != ESP_OK) {
+            xSemaphoreTake(s_mutex, portMAX_DELAY);
+            for (size_t i = 0; i < run; ++i) {
+                set_dirty(sector + i, true);
+            }
+            xSemaphoreGive(s_mutex);
+            return err;
+        }
+        sector += run;
+        *done += run;
+        if (*done >= next_report && total > 0) {
+            ESP_LOGI(TAG, "commit progress: %d/%d sectors", *done, total);
+            next_report += total / 4;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t commit_metadata(size_t meta_sectors, size_t* done)
+{
+    size_t capacity = journal_capacity();
+    if (capacity == 0) {
+        ESP_LOGW(TAG, "no journal partition, writing metadata without journal");
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    size_t count = count_dirty(0, meta_sectors);
+    if (count == 0) {
+        xSemaphoreGive(s_mutex);
+        return ESP_OK;
+    }
+    if (capacity == 0 || count > capacity) {
+        xSemaphoreGive(s_mutex);
+        uint8_t* buf = malloc(COMMIT_CHUNK_SIZE);
+        if (buf == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        if (capacity != 0) {
+            ESP_LOGW(TAG, "%d metadata sectors don't fit into the journal, writing them directly", count);
+        }
+        esp_err_t err = commit_data(0, meta_sectors, buf, done, 0);
+        free(buf);
+        return err;
+    }
+
+    /* snapshot all dirty metadata at once, so the journal holds a consistent tree */
+    uint8_t* data = heap_caps_malloc(count * s_sector_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (data == NULL) {
+        xSemaphoreGive(s_mutex);
+        return ESP_ERR_NO_MEM;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < meta_sectors; ++i) {
+        if (is_dirty(i)) {
+            s_journal_header.sectors[n] = i;
+            memcpy(data + n * s_sector_size, s_image + i * s_sector_size, s_sector_size);
+            set_dirty(i, false);
+            n++;
+        }
+    }
+    xSemaphoreGive(s_mutex);
+
+    TRACE_BEGIN_ARGS("journal_write", "sectors", count, "size", count * s_sector_size);
+    esp_err_t err = journal_write(data, count);
+    TRACE_END("journal_write");
+    for (size_t i = 0; i < count && err == ESP_OK; ++i) {
+        err = storage_flash_write(s_journal_header.sectors[i] * s_sector_size, s_sector_size,
+                                  data + i * s_sector_size);
+    }
+    if (err == ESP_OK) {
+        err = journal_clear();
+        *done += count;
+    } else {
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        for (size_t i = 0; i < count; ++i) {
+            set_dirty(s_journal_header.sectors[i], true);
+        }
+        xSemaphoreGive(s_mutex);
+    }
+    free(data);
+    return err;
+}
+
+/* Sectors from the start of the volume to the end of the FAT metadata region,
+ * including the MBR and the gap before the boot sector on a partitioned volume.
+ * 0 if there is no FAT boot sector. Must be called with s_mutex held.
+ */
+static size_t metadata_sectors(void)
+{
+    size_t boot_offset;
+    if (!storage_fat_boot_offset(s_image, s_sector_size, &boot_offset) ||
+            boot_offset + s_sector_size > s_sector_count * s_sector_size) {
+        return 0;
+    }
+    size_t meta_size = storage_fat_meta_size(s_image + boot_offset, s_sector_size);
+    if (meta_size == 0 || boot_offset + meta_size > s_sector_count * s_sector_size) {
+        return 0;
+    }
+    return (boot_offset + meta_size) / s_sector_size;
+}
+
+static void commit(void)
+{
+    uint8_t* buf = malloc(COMMIT_CHUNK_SIZE);
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "commit: out of memory");
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    size_t done = 0;
+    esp_err_t err = ESP_OK;
+    /* sectors written while committing are picked up by the next pass */
+    while (err == ESP_OK) {
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        size_t meta_sectors = metadata_sectors();
+        size_t total = count_dirty(0, s_sector_count);
+        xSemaphoreGive(s_mutex);
+        if (total == 0) {
+            break;
+        }
+        if (meta_sectors == 0) {
+            /* without the layout the journal can't protect the FATs and root directory */
+            ESP_LOGE(TAG, "no FAT boot sector on the staging disk, not committing %d sectors", total);
+            err = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        ESP_LOGI(TAG, "committing %d sectors to flash", total);
+        err = commit_data(meta_sectors, s_sector_count, buf, &done, total);
+        if (err == ESP_OK) {
+            err = commit_metadata(meta_sectors, &done);
+        }
+    }
+    free(buf);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "commit failed (0x%x), will retry on next eject", err);
+    } else if (done > 0) {
+        ESP_LOGI(TAG, "committed %d sectors in %d ms", done, (int) ((esp_timer_get_time() - start) / 1000));
+    }
+}
+
+static void commit_task(void* arg)
+{
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        governor_activity_begin(GOVERNOR_ACTIVITY_COMMIT);
+        TRACE_BEGIN("staging_commit");
+        commit();
+        TRACE_END("staging_commit");
+        governor_activity_end(GOVERNOR_ACTIVITY_COMMIT);
+    }
+}
+
+esp_err_t staging_enable(void)
+{
+    if (s_active) {
+        return ESP_OK;
+    }
+    size_t size = storage_get_size();
+    s_sector_size = storage_get_sector_size();
+    s_sector_count = size / s_sector_size;
+    s_image = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    s_dirty = calloc((s_sector_count + 31) / 32, sizeof(uint32_t));
+    s_mutex = xSemaphoreCreateMutex();
+    if (s_image == NULL || s_dirty == NULL || s_mutex == NULL) {
+        ESP_LOGE(TAG, "not enough memory for a %d byte staging disk", size);
+        goto fail;
+    }
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = storage_flash_read(0, size, s_image);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "failed to load volume (0x%x)", err);
+        goto fail;
+    }
+    ESP_LOGI(TAG, "loaded %d byte volume into PSRAM in %d ms", size, (int) ((esp_timer_get_time() - start) / 1000));
+
+    if (s_commit_task == NULL &&
+            xTaskCreate(commit_task, "staging_commit", 4 * 1024, NULL, 1, &s_commit_task) != pdPASS) {
+        goto fail;
+    }
+    s_active = true;
+    return ESP_OK;
+
+fail:
+    free(s_image);
+    free(s_dirty);
+    s_image = NULL;
+    s_dirty = NULL;
+    if (s_mutex != NULL) {
+        vSemaphoreDelete(s_mutex);
+        s_mutex = NULL;
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+bool staging_active(void)
+{
+    return s_active;
+}
+
+esp_err_t staging_read(size_t addr, size_t size, void* dest)
+{
+    if (addr + size > s_sector_count * s_sector_size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(dest, s_image + addr, size);
+    return ESP_OK;
+}
+
+esp_err_t staging_write(size_t addr, size_t size, const void* src)
+{
+    if (addr % s_sector_size != 0 || size % s_sector_size != 0 ||
+            addr + size > s_sector_count * s_sector_size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    memcpy(s_image + addr, src, size);
+    for (size_t sector = addr / s_sector_size; sector < (addr + size) / s_sector_size; ++sector) {
+        set_dirty(sector, true);
+    }
+    xSemaphoreGive(s_mutex);
+    return ESP_OK;
+}
+
+void staging_commit(void)
+{
+    if (s_active) {
+        xTaskNotifyGive(s_commit_task);
+    }
+}
+
+static DSTATUS diskio_init(unsigned char pdrv)
+{
+    return 0;
+}
+
+static DSTATUS diskio_status(unsigned char pdrv)
+{
+    return 0;
+}
+
+static DRESULT diskio_read(unsigned char pdrv, unsigned char* buff, uint32_t sector, unsigned count)
+{
+    esp_err_t err = staging_read(sector * s_sector_size, count * s_sector_size, buff);
+    return (err == ESP_OK) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT diskio_write(unsigned char pdrv, const unsigned char* buff, uint32_t sector, unsigned count)
+{
+    esp_err_t err = staging_write(sector * s_sector_size, count * s_sector_size, buff);
+    return (err == ESP_OK) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT diskio_ioctl(unsigned char pdrv, unsigned char cmd, void* buff)
+{
+    switch (cmd) {
+    case CTRL_SYNC:
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *((DWORD*) buff) = s_sector_count;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *((WORD*) buff) = s_sector_size;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *((DWORD*) buff) = 1;
+        return RES_OK;
+    default:
+        return RES_ERROR;
+    }
+}
+
+esp_err_t staging_register_diskio(uint8_t pdrv)
+{
+    static const ff_diskio_impl_t staging_impl = {
+        .init = &diskio_init,
+        .status = &diskio_status,
+        .read = &diskio_read,
+        .write = &diskio_write,
+        .ioctl = &diskio_ioctl,
+    };
+    ff_diskio_register(pdrv, &staging_impl);
+    return ESP_OK;
+}
@@ -1,21 +1,60 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include <assert.h>
 #include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "esp_vfs.h"
 #include "esp_vfs_fat.h"
 #include "diskio_impl.h"
 #include "diskio_wl.h"
 #include "wear_levelling.h"
+#include "common.h"
 
 
 static wl_handle_t s_wl_handle = WL_INVALID_HANDLE;
 static bool s_fat_mounted;
+static bool s_fat_formatted;
+static BYTE s_pdrv = 0xFF;
 static const char* s_base_path;
 
 static const char* TAG = "storage";
 
+/* Read cache for MSC access.
+ * The FAT metadata region (boot sector, FATs, root directory) is kept resident,
+ * sequential reads of the data region are served from a read-ahead buffer.
+ * Both live in PSRAM when it is available. Writes through storage_write_sector
+ * update the cached copies. Writes by the firmware FATFS driver bypass this
+ * layer, so the cache is dropped whenever the firmware mounts or unmounts FAT.
+ */
+#define CACHE_META_MAX_SIZE     (64 * 1024)
+#define CACHE_READAHEAD_SIZE    (32 * 1024)
+#define CACHE_LATENCY_BUCKETS   12
+
+typedef struct {
+    uint8_t* meta;              /* copy of [0, meta_size) */
+    size_t meta_size;
+    size_t boot_offset;         /* of the FAT boot sector, after the MBR if there is one */
+    bool meta_valid;
+    uint8_t* readahead;
+    size_t ra_addr;
+    size_t ra_len;
+    size_t last_read_end;
+    uint32_t meta_hits;
+    uint32_t ra_hits;
+    uint32_t misses;
+    uint32_t prefetches;
+    uint32_t latency_hist[CACHE_LATENCY_BUCKETS];  /* bucket n: latency below 2^(n+1) us */
+    int64_t bytes_read;
+    int64_t read_time_us;
+} storage_cache_t;
+
+static storage_cache_t s_cache;
+
+static void cache_invalidate(void);
+
 esp_err_t storage_init_wl(void)
 {
     ESP_LOGI(TAG, "Initializing wear levelling");
@@ -33,6 +72,12 @@ esp_err_t storage_init_wl(void)
         return err;
     }
 
+    /* finish a staging commit interrupted by a reset */
+    err = staging_recover();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "failed to recover staging journal (0x%x)", err);
+    }
+
     return ESP_OK;
 }
 
@@ -58,6 +103,8 @@ esp_err_t storage_mount_fat(const char* base_path)
     }
 
     ESP_LOGI(TAG, "Initializing FAT");
+    cache_invalidate();
+    s_fat_formatted = false;
 
     // connect driver to FATFS
     BYTE pdrv = 0xFF;
@@ -68,9 +115,13 @@ esp_err_t storage_mount_fat(const char* base_path)
     ESP_LOGD(TAG, "using pdrv=%i", pdrv);
     char drv[3] = {(char)('0' + pdrv), ':', 0};
 
-    err = ff_diskio_register_wl_partition(pdrv, s_wl_handle);
+    if (staging_active()) {
+        err = staging_register_diskio(pdrv);
+    } else {
+        err = ff_diskio_register_wl_partition(pdrv, s_wl_handle);
+    }
     if (err!= ESP_OK) {
-        ESP_LOGE(TAG, "ff_diskio_register_wl_partition failed pdrv=%d (0x%x)", pdrv, err);
+        ESP_LOGE(TAG, "registering disk I/O failed pdrv=%d (0x%x)", pdrv, err);
         goto fail;
     }
     FATFS *fs;
@@ -83,7 +134,9 @@ esp_err_t storage_mount_fat(const char* base_path)
     }
 
     // Try to mount partition
+    TRACE_BEGIN("fat_mount");
     FRESULT fresult = f_mount(fs, drv, 1);
+    TRACE_END("fat_mount");
     if (fresult != FR_OK) {
         ESP_LOGW(TAG, "f_mount failed (%d)", fresult);
         if (!((fresult == FR_NO_FILESYSTEM || fresult == FR_INT_ERR))) {
@@ -100,7 +153,10 @@ esp_err_t storage_mount_fat(const char* base_path)
                 4096);
 
         ESP_LOGI(TAG, "Formatting FATFS partition, allocation unit size=%d", alloc_unit_size);
-        fresult = f_mkfs(drv, FM_FAT, alloc_unit_size, workbuf, workbuf_size);
+        TRACE_BEGIN("fat_format");
+        /* no partition table, like esp_vfs_fat_spiflash, so the boot sector is sector 0 */
+        fresult = f_mkfs(drv, FM_FAT | FM_SFD, alloc_unit_size, workbuf, workbuf_size);
+        TRACE_END("fat_format");
         if (fresult != FR_OK) {
             err = ESP_FAIL;
             ESP_LOGE(TAG, "f_mkfs failed (%d)", fresult);
@@ -108,6 +164,7 @@ esp_err_t storage_mount_fat(const char* base_path)
         }
         free(workbuf);
         workbuf = NULL;
+        s_fat_formatted = true;
         ESP_LOGI(TAG, "Mounting again");
         fresult = f_mount(fs, drv, 0);
         if (fresult != FR_OK) {
@@ -117,6 +174,7 @@ esp_err_t storage_mount_fat(const char* base_path)
         }
     }
     s_fat_mounted = true;
+    s_pdrv = pdrv;
     s_base_path = base_path;
 
     return ESP_OK;
@@ -130,24 +188,36 @@ fail:
     return err;
 }
 
+bool storage_fat_formatted(void)
+{
+    return s_fat_formatted;
+}
+
 esp_err_t storage_unmount_fat(void)
 {
     if (!s_fat_mounted) {
         return ESP_OK;
     }
 
-    BYTE pdrv = ff_diskio_get_pdrv_wl(s_wl_handle);
+    BYTE pdrv = s_pdrv;
     if (pdrv == 0xff) {
         return ESP_ERR_INVALID_STATE;
     }
     char drv[3] = {(char)('0' + pdrv), ':', 0};
 
+    TRACE_BEGIN("fat_unmount");
     f_mount(0, drv, 0);
     ff_diskio_unregister(pdrv);
-    ff_diskio_clear_pdrv_wl(s_wl_handle);
+    if (!staging_active()) {
+        ff_diskio_clear_pdrv_wl(s_wl_handle);
+    }
+    s_pdrv = 0xFF;
     esp_err_t err = esp_vfs_fat_unregister_path(s_base_path);
     s_base_path = NULL;
     s_fat_mounted = false;
+    /* the firmware may have written files while FAT was mounted */
+    cache_invalidate();
+    TRACE_END("fat_unmount");
 
     return err;
 
@@ -167,11 +237,247 @@ size_t storage_get_sector_size(void)
     return wl_sector_size(s_wl_handle);
 }
 
+static void* cache_alloc(size_t size)
+{
+    void* buf = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (buf == NULL) {
+        buf = malloc(size);
+    }
+    return buf;
+}
+
+static void cache_invalidate(void)
+{
+    s_cache.meta_valid = false;
+    s_cache.ra_len = 0;
+    s_cache.last_read_end = 0;
+}
+
+static uint16_t read_le16(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Size of the FAT metadata region (reserved sectors, FATs, root directory),
+ * counted from the boot sector. 0 if bs isn't a FAT boot sector.
+ */
+size_t storage_fat_meta_size(const uint8_t* bs, size_t sector_size)
+{
+    uint16_t bytes_per_sector = read_le16(bs + 11);
+    bool jump = (bs[0] == 0xeb || bs[0] == 0xe9 || bs[0] == 0xe8);
+    if (bs[510] != 0x55 || bs[511] != 0xaa || !jump || bytes_per_sector != sector_size ||
+            read_le16(bs + 14) == 0 || bs[16] == 0) {
+        return 0;
+    }
+    uint32_t fat_size = read_le16(bs + 22);
+    if (fat_size == 0) {
+        fat_size = read_le32(bs + 36);
+    }
+    size_t root_dir_sectors = (read_le16(bs + 17) * 32 + sector_size - 1) / sector_size;
+    return (read_le16(bs + 14) + bs[16] * fat_size + root_dir_sectors) * sector_size;
+}
+
+/* Finds the FAT boot sector. The firmware formats the volume without a partition
+ * table, so it's sector 0, but hosts and older firmware put an MBR there and the
+ * boot sector at the start of the first partition.
+ */
+bool storage_fat_boot_offset(const uint8_t* sector0, size_t sector_size, size_t* out_offset)
+{
+    if (storage_fat_meta_size(sector0, sector_size) != 0) {
+        *out_offset = 0;
+        return true;
+    }
+    const uint8_t* entry = sector0 + 446;
+    if (sector0[510] != 0x55 || sector0[511] != 0xaa || entry[4] == 0 || read_le32(entry + 8) == 0) {
+        return false;
+    }
+    *out_offset = read_le32(entry + 8) * sector_size;
+    return true;
+}
+
+/* Finds the end of the metadata region, including the MBR and the gap before the
+ * boot sector, and loads [0, end) into the cache
+ */
+static void cache_load_meta(void)
+{
+    size_t sector_size = wl_sector_size(s_wl_handle);
+    size_t volume_size = wl_size(s_wl_handle);
+    uint8_t* bs = malloc(sector_size);
+    size_t boot_offset = 0;
+    size_t meta_size = 0;
+    if (bs == NULL || wl_read(s_wl_handle, 0, bs, sector_size) != ESP_OK) {
+        free(bs);
+        return;
+    }
+    if (storage_fat_boot_offset(bs, sector_size, &boot_offset) && boot_offset + sector_size <= volume_size &&
+            (boot_offset == 0 || wl_read(s_wl_handle, boot_offset, bs, sector_size) == ESP_OK)) {
+        meta_size = storage_fat_meta_size(bs, sector_size);
+    }
+    free(bs);
+
+    if (meta_size == 0 || boot_offset + meta_size > MIN(CACHE_META_MAX_SIZE, volume_size)) {
+        /* not formatted yet or unexpected layout, only cache sector 0 */
+        ESP_LOGW(TAG, "no FAT metadata region found, caching sector 0 only");
+        boot_offset = 0;
+        meta_size = sector_size;
+    }
+    meta_size += boot_offset;
+    if (s_cache.meta == NULL) {
+        s_cache.meta = cache_alloc(CACHE_META_MAX_SIZE);
+        if (s_cache.meta == NULL) {
+            return;
+        }
+    }
+    if (wl_read(s_wl_handle, 0, s_cache.meta, meta_size) != ESP_OK) {
+        return;
+    }
+    s_cache.meta_size = meta_size;
+    s_cache.boot_offset = boot_offset;
+    s_cache.meta_valid = true;
+    ESP_LOGD(TAG, "cached %d bytes of FAT metadata, boot sector at %d", meta_size, boot_offset);
+}
+
+static esp_err_t flash_read(size_t addr, void* dest, size_t size)
+{
+    TRACE_BEGIN_ARGS("flash_read", "addr", addr, "size", size);
+    esp_err_t err = wl_read(s_wl_handle, addr, dest, size);
+    TRACE_END("flash_read");
+    return err;
+}
+
+static esp_err_t cache_read_data(size_t addr, size_t size, uint8_t* dest)
+{
+    if (addr >= s_cache.ra_addr && addr + size <= s_cache.ra_addr + s_cache.ra_len) {
+        memcpy(dest, s_cache.readahead + (addr - s_cache.ra_addr), size);
+        s_cache.ra_hits++;
+        return ESP_OK;
+    }
+    bool sequential = (addr == s_cache.last_read_end);
+    if (sequential && size < CACHE_READAHEAD_SIZE) {
+        if (s_cache.readahead == NULL) {
+            s_cache.readahead = cache_alloc(CACHE_READAHEAD_SIZE);
+        }
+        if (s_cache.readahead != NULL) {
+            size_t len = MIN(CACHE_READAHEAD_SIZE, wl_size(s_wl_handle) - addr);
+            esp_err_t err = flash_read(addr, s_cache.readahead, len);
+            if (err != ESP_OK) {
+                s_cache.ra_len = 0;
+                return err;
+            }
+            s_cache.ra_addr = addr;
+            s_cache.ra_len = len;
+            s_cache.prefetches++;
+            memcpy(dest, s_cache.readahead, size);
+            return ESP_OK;
+        }
+    }
+    s_cache.misses++;
+    return flash_read(addr, dest, size);
+}
+
+static void cache_record_latency(int64_t latency_us, size_t size)
+{
+    int bucket = 0;
+    while (bucket < CACHE_LATENCY_BUCKETS - 1 && latency_us >= (2LL << bucket)) {
+        bucket++;
+    }
+    s_cache.latency_hist[bucket]++;
+    s_cache.bytes_read += size;
+    s_cache.read_time_us += latency_us;
+}
+
 esp_err_t storage_read_sector(size_t addr, size_t size, void* dest)
 {
     assert(s_wl_handle != WL_INVALID_HANDLE);
 
-    return wl_read(s_wl_handle, addr, dest, size);
+    if (staging_active()) {
+        return staging_read(addr, size, dest);
+    }
+    if (s_fat_mounted) {
+        return flash_read(addr, dest, size);
+    }
+
+    int64_t start = esp_timer_get_time();
+    const size_t total_size = size;
+    const size_t read_end = addr + size;
+    if (!s_cache.meta_valid) {
+        cache_load_meta();
+    }
+    esp_err_t err = ESP_OK;
+    uint8_t* out = (uint8_t*) dest;
+    if (s_cache.meta_valid && addr < s_cache.meta_size) {
+        size_t len = MIN(size, s_cache.meta_size - addr);
+        memcpy(out, s_cache.meta + addr, len);
+        s_cache.meta_hits++;
+        addr += len;
+        out += len;
+        size -= len;
+    }
+    if (size > 0) {
+        err = cache_read_data(addr, size, out);
+    }
+    s_cache.last_read_end = read_end;
+    cache_record_latency(esp_timer_get_time() - start, total_size);
+    return err;
+}
+
+static void cache_update(size_t addr, size_t size, const uint8_t* src)
+{
+    if (addr == 0 || (addr <= s_cache.boot_offset && addr + size > s_cache.boot_offset)) {
+        /* MBR or boot sector rewritten, the region layout may have changed */
+        s_cache.meta_valid = false;
+    }
+    if (s_cache.meta_valid && addr < s_cache.meta_size) {
+        memcpy(s_cache.meta + addr, src, MIN(size, s_cache.meta_size - addr));
+    }
+    size_t ra_end = s_cache.ra_addr + s_cache.ra_len;
+    if (s_cache.ra_len > 0 && addr < ra_end && addr + size > s_cache.ra_addr) {
+        size_t from = MAX(addr, s_cache.ra_addr);
+        size_t to = MIN(addr + size, ra_end);
+        memcpy(s_cache.readahead + (from - s_cache.ra_addr), src + (from - addr), to - from);
+    }
+}
+
+void storage_cache_log_stats(void)
+{
+    uint32_t reads = 0;
+    for (int i = 0; i < CACHE_LATENCY_BUCKETS; ++i) {
+        reads += s_cache.latency_hist[i];
+    }
+    if (reads == 0) {
+        return;
+    }
+    uint32_t hits = s_cache.meta_hits + s_cache.ra_hits;
+    uint32_t lookups = hits + s_cache.prefetches + s_cache.misses;
+    ESP_LOGI(TAG, "read cache: %d reads, %d%% hits (metadata %d, read-ahead %d), %d prefetches, %d misses",
+             reads, lookups ? (int) (hits * 100 / lookups) : 0,
+             s_cache.meta_hits, s_cache.ra_hits, s_cache.prefetches, s_cache.misses);
+    ESP_LOGI(TAG, "read throughput: %d kB in %d ms", (int) (s_cache.bytes_read / 1024),
+             (int) (s_cache.read_time_us / 1000));
+    char line[CACHE_LATENCY_BUCKETS * 18];
+    size_t pos = 0;
+    for (int i = 0; i < CACHE_LATENCY_BUCKETS; ++i) {
+        int len = snprintf(line + pos, sizeof(line) - pos, " <%d:%u", 2 << i, s_cache.latency_hist[i]);
+        if (len < 0 || (size_t) len >= sizeof(line) - pos) {
+            /* truncated, the line is full */
+            break;
+        }
+        pos += len;
+    }
+    ESP_LOGI(TAG, "read latency histogram (us):%s", line);
+
+    memset(s_cache.latency_hist, 0, sizeof(s_cache.latency_hist));
+    s_cache.meta_hits = 0;
+    s_cache.ra_hits = 0;
+    s_cache.prefetches = 0;
+    s_cache.misses = 0;
+    s_cache.bytes_read = 0;
+    s_cache.read_time_us = 0;
 }
 
 esp_err_t storage_write_sector(size_t addr, size_t size, const void* src)
@@ -182,15 +488,43 @@ esp_err_t storage_write_sector(size_t addr, size_t size, const void* src)
         ESP_LOGE(TAG, "can't write, FAT mounted");
         return ESP_ERR_INVALID_STATE;
     }
+    if (staging_active()) {
+        return staging_write(addr, size, src);
+    }
+    return storage_flash_write(addr, size, src);
+}
+
+esp_err_t storage_flash_read(size_t addr, size_t size, void* dest)
+{
+    assert(s_wl_handle != WL_INVALID_HANDLE);
+
+    return flash_read(addr, dest, size);
+}
+
+esp_err_t storage_flash_write(size_t addr, size_t size, const void* src)
+{
+    assert(s_wl_handle != WL_INVALID_HANDLE);
+
     size_t sector_size = wl_sector_size(s_wl_handle);
     if (addr % sector_size != 0 || size % sector_size != 0) {
         return ESP_ERR_INVALID_ARG;
     }
+    TRACE_BEGIN_ARGS("flash_erase", "addr", addr, "size", size);
     esp_err_t err = wl_erase_range(s_wl_handle, addr, size);
+    TRACE_END("flash_erase");
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "wl_erase_range failed (0x%x)", err);
+        cache_invalidate();
+        return err;
+    }
+    TRACE_BEGIN_ARGS("flash_write", "addr", addr, "size", size);
+    err = wl_write(s_wl_handle, addr, src, size);
+    TRACE_END("flash_write");
+    if (err != ESP_OK) {
+        cache_invalidate();
         return err;
     }
-    return wl_write(s_wl_handle, addr, src, size);
+    cache_update(addr, size, src);
+    return ESP_OK;
 }
 
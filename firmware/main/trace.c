@@ -0,0 +1,258 @@
+#ifndef ESP_PLATFORM
+#define _GNU_SOURCE   /* pthread_getname_np */
+#endif
+#include "trace.h"
+
+#if CONFIG_WASM_DEMO_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#ifndef CONFIG_WASM_DEMO_TRACE_EVENTS
+#define CONFIG_WASM_DEMO_TRACE_EVENTS 1024
+#endif
+
+#define TRACE_MAX_THREADS   8
+#define TRACE_RING_EVENTS   CONFIG_WASM_DEMO_TRACE_EVENTS
+
+typedef struct {
+    int64_t ts_us;
+    const char* name;
+    const char* arg_names[2];
+    int32_t args[2];
+    trace_phase_t phase;
+} trace_event_t;
+
+typedef struct {
+    char thread_name[16];
+    atomic_uint head;           /* number of events recorded, written by the owning task only */
+    atomic_uint dumped;         /* events up to here were written by trace_dump() */
+    atomic_bool released;       /* the owning task has exited, another task can take the ring over */
+    trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+/* marks a task which couldn't get a ring, so allocation isn't retried on every event */
+static trace_ring_t s_no_ring;
+
+static _Atomic(trace_ring_t*) s_rings[TRACE_MAX_THREADS];
+static atomic_uint s_ring_count;
+static atomic_bool s_paused;
+/* events lost outside of ring overruns: of tasks without a ring, and of taken over rings */
+static atomic_uint s_dropped;
+static __thread trace_ring_t* t_ring;
+
+static int64_t trace_time_us(void)
+{
+#ifdef ESP_PLATFORM
+    return esp_timer_get_time();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void current_thread_name(char* name, size_t size)
+{
+#ifdef ESP_PLATFORM
+    strlcpy(name, pcTaskGetTaskName(NULL), size);
+#else
+    if (pthread_getname_np(pthread_self(), name, size) != 0) {
+        name[0] = 0;
+    }
+#endif
+}
+
+static trace_ring_t* ring_alloc(void)
+{
+#ifdef ESP_PLATFORM
+    trace_ring_t* ring = heap_caps_calloc(1, sizeof(trace_ring_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(trace_ring_t));
+    }
+#else
+    trace_ring_t* ring = calloc(1, sizeof(trace_ring_t));
+#endif
+    return ring;
+}
+
+static bool ring_claim(trace_ring_t* ring)
+{
+    bool released = true;
+    return atomic_compare_exchange_strong(&ring->released, &released, false);
+}
+
+/* Takes over the ring of an exited task. A ring left by a task of the same name
+ * keeps its events, they continue on the same trace thread. With any_name, a ring
+ * of another task is renamed and its events not yet dumped are dropped.
+ */
+static trace_ring_t* ring_recycle(const char* name, bool any_name)
+{
+    trace_ring_t* other = NULL;
+    for (unsigned tid = 0; tid < TRACE_MAX_THREADS; ++tid) {
+        trace_ring_t* ring = atomic_load_explicit(&s_rings[tid], memory_order_acquire);
+        if (ring == NULL || !atomic_load(&ring->released)) {
+            continue;
+        }
+        if (strncmp(ring->thread_name, name, sizeof(ring->thread_name)) == 0) {
+            if (ring_claim(ring)) {
+                return ring;
+            }
+        } else if (other == NULL) {
+            other = ring;
+        }
+    }
+    if (!any_name || other == NULL || !ring_claim(other)) {
+        return NULL;
+    }
+    unsigned head = atomic_load(&other->head);
+    atomic_fetch_add(&s_dropped, head - atomic_load(&other->dumped));
+    atomic_store(&other->dumped, head);
+    snprintf(other->thread_name, sizeof(other->thread_name), "%s", name);
+    return other;
+}
+
+static trace_ring_t* thread_ring(void)
+{
+    trace_ring_t* ring = t_ring;
+    if (ring != NULL) {
+        return ring;
+    }
+    char name[sizeof(ring->thread_name)];
+    current_thread_name(name, sizeof(name));
+
+    /* tasks which come and go, like the wasm task, take over their predecessor's ring */
+    ring = (name[0] != 0) ? ring_recycle(name, false) : NULL;
+    if (ring == NULL) {
+        unsigned index = atomic_fetch_add(&s_ring_count, 1);
+        if (index < TRACE_MAX_THREADS) {
+            ring = ring_alloc();
+            if (ring != NULL) {
+                if (name[0] == 0) {
+                    snprintf(ring->thread_name, sizeof(ring->thread_name), "thread %u", index);
+                } else {
+                    snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", name);
+                }
+                atomic_store_explicit(&s_rings[index], ring, memory_order_release);
+            }
+        } else {
+            atomic_fetch_sub(&s_ring_count, 1);
+            ring = ring_recycle(name, true);
+        }
+    }
+    if (ring == NULL) {
+        ring = &s_no_ring;
+    }
+    t_ring = ring;
+    return ring;
+}
+
+void trace_thread_exit(void)
+{
+    trace_ring_t* ring = t_ring;
+    t_ring = NULL;
+    if (ring != NULL && ring != &s_no_ring) {
+        atomic_store(&ring->released, true);
+    }
+}
+
+void trace_record(trace_phase_t phase, const char* name,
+                  const char* arg0_name, int32_t arg0, const char* arg1_name, int32_t arg1)
+{
+    if (atomic_load_explicit(&s_paused, memory_order_acquire)) {
+        return;
+    }
+    trace_ring_t* ring = thread_ring();
+    if (ring == &s_no_ring) {
+        atomic_fetch_add_explicit(&s_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t* ev = &ring->events[head % TRACE_RING_EVENTS];
+    ev->ts_us = trace_time_us();
+    ev->name = name;
+    ev->arg_names[0] = arg0_name;
+    ev->arg_names[1] = arg1_name;
+    ev->args[0] = arg0;
+    ev->args[1] = arg1;
+    ev->phase = phase;
+    /* publish the event to trace_dump() */
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void write_event(FILE* f, unsigned tid, const trace_event_t* ev)
+{
+    static const char phases[] = { 'B', 'E', 'i' };
+    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%u",
+            ev->name, phases[ev->phase], (long long) ev->ts_us, tid);
+    if (ev->phase == TRACE_PHASE_INSTANT) {
+        fprintf(f, ",\"s\":\"t\"");
+    }
+    if (ev->arg_names[0] != NULL) {
+        fprintf(f, ",\"args\":{\"%s\":%d", ev->arg_names[0], ev->args[0]);
+        if (ev->arg_names[1] != NULL) {
+            fprintf(f, ",\"%s\":%d", ev->arg_names[1], ev->args[1]);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "}");
+}
+
+int trace_dump(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    /* Stop recording, so that the file writes below don't end up in the trace
+     * and the rings aren't overwritten while they are being read.
+     */
+    atomic_store(&s_paused, true);
+
+    int count = 0;
+    unsigned dropped = atomic_exchange(&s_dropped, 0);
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+               "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"wasm3 demo\"}}");
+    for (unsigned tid = 0; tid < TRACE_MAX_THREADS; ++tid) {
+        trace_ring_t* ring = atomic_load_explicit(&s_rings[tid], memory_order_acquire);
+        if (ring == NULL) {
+            continue;
+        }
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                tid, ring->thread_name);
+
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        /* skip the oldest slot, a task which saw s_paused too late may still be writing to it */
+        unsigned start = (head >= TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS + 1 : 0;
+        unsigned dumped = atomic_load(&ring->dumped);
+        if (start < dumped) {
+            start = dumped;
+        } else {
+            dropped += start - dumped;
+        }
+        for (unsigned i = start; i != head; ++i) {
+            write_event(f, tid, &ring->events[i % TRACE_RING_EVENTS]);
+            count++;
+        }
+        atomic_store(&ring->dumped, head);
+    }
+    fprintf(f, "\n],\"otherData\":{\"dropped_events\":%u}}\n", dropped);
+    fclose(f);
+
+    atomic_store(&s_paused, false);
+    return count;
+}
+
+#endif // CONFIG_WASM_DEMO_TRACE
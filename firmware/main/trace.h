@@ -0,0 +1,61 @@
+#pragma once
+
+/* Cross-task event trace.
+ * Each task records begin/end events into its own ring buffer, so recording
+ * doesn't take locks or block. trace_dump() writes the events recorded since the
+ * previous dump in Chrome trace event format (chrome://tracing, Perfetto).
+ * With CONFIG_WASM_DEMO_TRACE disabled the macros compile to nothing.
+ * trace.c doesn't require ESP-IDF and can be built on a Linux host, define
+ * CONFIG_WASM_DEMO_TRACE=1 there.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if CONFIG_WASM_DEMO_TRACE
+
+typedef enum {
+    TRACE_PHASE_BEGIN,
+    TRACE_PHASE_END,
+    TRACE_PHASE_INSTANT,
+} trace_phase_t;
+
+/* name and arg names must be string literals, only the pointers are stored */
+void trace_record(trace_phase_t phase, const char* name,
+                  const char* arg0_name, int32_t arg0, const char* arg1_name, int32_t arg1);
+
+/* Call before a task exits, so its ring doesn't stay allocated. The next task of
+ * the same name continues in the ring; once all rings are taken, any new task can
+ * take it over, dropping the events not dumped yet.
+ */
+void trace_thread_exit(void);
+
+/* Returns the number of events written, or -1 if the file can't be created */
+int trace_dump(const char* path);
+
+#define TRACE_BEGIN(name)                       trace_record(TRACE_PHASE_BEGIN, name, NULL, 0, NULL, 0)
+#define TRACE_BEGIN_ARGS(name, k0, v0, k1, v1)  trace_record(TRACE_PHASE_BEGIN, name, k0, (int32_t) (v0), k1, (int32_t) (v1))
+#define TRACE_END(name)                         trace_record(TRACE_PHASE_END, name, NULL, 0, NULL, 0)
+#define TRACE_INSTANT(name, k0, v0)             trace_record(TRACE_PHASE_INSTANT, name, k0, (int32_t) (v0), NULL, 0)
+#define TRACE_THREAD_EXIT()                     trace_thread_exit()
+
+#else
+
+#define TRACE_BEGIN(name)                       ((void) 0)
+#define TRACE_BEGIN_ARGS(name, k0, v0, k1, v1)  ((void) 0)
+#define TRACE_END(name)                         ((void) 0)
+#define TRACE_INSTANT(name, k0, v0)             ((void) 0)
+#define TRACE_THREAD_EXIT()                     ((void) 0)
+
+#endif // CONFIG_WASM_DEMO_TRACE
+
+#ifdef __cplusplus
+}
+#endif
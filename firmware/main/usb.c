@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #if __has_include("esp_private/periph_ctrl.h")
 #include "esp_private/periph_ctrl.h"
 #else
@@ -15,6 +16,7 @@
 #include "freertos/task.h"
 #include "tusb.h"
 #include "sdkconfig.h"
+#include "common.h"
 
 static const char *TAG = "usb";
 
@@ -28,6 +30,11 @@ enum {
 
 #define MAC_BYTES       6
 
+#ifndef CONFIG_WASM_DEMO_USB_VBUS_GPIO
+#define CONFIG_WASM_DEMO_USB_VBUS_GPIO -1
+#endif
+#define VBUS_POLL_US    (200 * 1000)
+
 static char serial_descriptor[MAC_BYTES * 2 + 1] = {'\0'}; // 2 chars per hexnumber + '\0'
 static uint16_t s_desc_str[32];
 
@@ -123,6 +130,54 @@ uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
     return s_desc_str;
 }
 
+void tud_mount_cb(void)
+{
+    ESP_LOGI(TAG, "USB mounted");
+}
+
+void tud_umount_cb(void)
+{
+    ESP_LOGI(TAG, "USB unmounted");
+}
+
+#if CONFIG_WASM_DEMO_USB_VBUS_GPIO >= 0
+static bool s_vbus_present;
+
+static void vbus_poll_cb(void* arg)
+{
+    bool present = gpio_get_level(CONFIG_WASM_DEMO_USB_VBUS_GPIO);
+    if (present != s_vbus_present) {
+        ESP_LOGI(TAG, "VBUS %s", present ? "present" : "absent");
+        s_vbus_present = present;
+        governor_set_usb_present(present);
+    }
+}
+#endif
+
+/* The governor keeps the bus clock up while a host may enumerate the device, so
+ * this has to run before the PHY is enabled. Without VBUS sensing, that's as long
+ * as the PHY is enabled.
+ */
+static void init_vbus_sense(void)
+{
+#if CONFIG_WASM_DEMO_USB_VBUS_GPIO >= 0
+    gpio_reset_pin(CONFIG_WASM_DEMO_USB_VBUS_GPIO);
+    gpio_set_direction(CONFIG_WASM_DEMO_USB_VBUS_GPIO, GPIO_MODE_INPUT);
+    s_vbus_present = gpio_get_level(CONFIG_WASM_DEMO_USB_VBUS_GPIO);
+    governor_set_usb_present(s_vbus_present);
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &vbus_poll_cb,
+        .name = "usb_vbus",
+    };
+    esp_timer_handle_t timer;
+    ESP_ERROR_CHECK( esp_timer_create(&timer_args, &timer) );
+    ESP_ERROR_CHECK( esp_timer_start_periodic(timer, VBUS_POLL_US) );
+#else
+    governor_set_usb_present(true);
+#endif
+}
+
 static void configure_pins(usb_hal_context_t *usb)
 {
     /* usb_periph_iopins currently configures USB_OTG as USB Device.
@@ -159,6 +214,7 @@ static void tusb_device_task(void *pvParameters)
 void usb_init(void)
 {
     init_serial_no();
+    init_vbus_sense();
 
     periph_module_reset(PERIPH_USB_MODULE);
     periph_module_enable(PERIPH_USB_MODULE);
@@ -1,73 +1,647 @@
-#include <fstream>
+#include <algorithm>
+#include <istream>
+#include <mutex>
+#include <set>
 #include <string>
+#include <vector>
+#include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "wasm3.h"
 #include "wasm3_cpp.h"
+#include "m3_env.h"
 #include "m3_api_esp_wasi.h"
 #include "common.h"
+#include "wasm_stream.h"
+
+static const char* TAG = "wasm";
+
+/* records a trace span for the lifetime of the object, also when the interpreter throws */
+class trace_scope
+{
+public:
+    trace_scope(const char* name, const char* arg0_name = NULL, int32_t arg0 = 0,
+                const char* arg1_name = NULL, int32_t arg1 = 0) : m_name(name)
+    {
+        TRACE_BEGIN_ARGS(name, arg0_name, arg0, arg1_name, arg1);
+    }
+    ~trace_scope()
+    {
+        TRACE_END(m_name);
+    }
+private:
+    const char* m_name;
+};
+
+/* State of one running module. Several modules can run at the same time, each in
+ * its own task with its own events. The modules started together form a run; the
+ * first one of the latest run owns checkpoints and stack profiles.
+ */
+struct wasm_instance
+{
+    std::string file_name;
+    size_t task_stack_size;
+    size_t env_stack_size;
+    uint32_t module_hash;
+    uint32_t run_id;
+    bool primary;
+    governor_level_t run_level;
+    IM3Runtime m3_runtime;
+    IM3Module m3_module;
+    int64_t start_time_us;
+    bool resumed;
+    uint32_t cold_start_ms;
+    uint32_t activities;        /* governor activities this instance has begun */
+    uint32_t channels;          /* bit per open channel handle */
+    std::set<std::string> opened_channels;  /* names of the channels it opened, protected by s_instances_mutex */
+    events_ctx_t* events;       /* timers, GPIOs and posted events of this module */
+    bool event_loop_exit;
+};
+
+/* the instance running in the calling task, imports are called from its wasm task */
+static __thread wasm_instance* t_instance;
+
+static std::mutex s_instances_mutex;
+static std::vector<wasm_instance*> s_instances;
+static uint32_t s_run_id;
+
+/* a module of an older run which is still running doesn't own checkpoints anymore */
+static bool instance_owns_checkpoints(wasm_instance* inst)
+{
+    std::lock_guard<std::mutex> lock(s_instances_mutex);
+    return inst->primary && inst->run_id == s_run_id;
+}
+
+/* begins or ends a governor activity once per instance, the governor counts instances */
+static void instance_activity(wasm_instance* inst, governor_activity_t activity, bool active)
+{
+    uint32_t bit = GOVERNOR_ACTIVITY_BIT(activity);
+    if (active && !(inst->activities & bit)) {
+        inst->activities |= bit;
+        if (activity == GOVERNOR_ACTIVITY_RUN) {
+            governor_run_begin(inst->run_level);
+        } else {
+            governor_activity_begin(activity);
+        }
+    } else if (!active && (inst->activities & bit)) {
+        inst->activities &= ~bit;
+        if (activity == GOVERNOR_ACTIVITY_RUN) {
+            governor_run_end(inst->run_level);
+        } else {
+            governor_activity_end(activity);
+        }
+    }
+}
 
 /********************************************************************************/
 /***** You can define additional functions to be linked to the module here *****/
 
 static void delay_ms(int ms)
 {
+    trace_scope trace("delay_ms", "ms", ms);
+    instance_activity(t_instance, GOVERNOR_ACTIVITY_RUN, false);
     usleep(ms * 1000);
+    instance_activity(t_instance, GOVERNOR_ACTIVITY_RUN, true);
+}
+
+/* Event API: the module registers event sources, returns from main, and the
+ * firmware then calls its exported on_event(type, id, value) function for each event.
+ * Every module has its own timers and events; a GPIO can be watched by one module.
+ */
+static int timer_start(int id, int period_ms, int periodic)
+{
+    events_ctx_t* events = t_instance->events;
+    return (events != NULL && events_timer_start(events, id, period_ms, periodic != 0) == ESP_OK) ? 0 : -1;
+}
+
+static int timer_stop(int id)
+{
+    events_ctx_t* events = t_instance->events;
+    return (events != NULL && events_timer_stop(events, id) == ESP_OK) ? 0 : -1;
+}
+
+static int gpio_watch(int gpio_num, int edge)
+{
+    events_ctx_t* events = t_instance->events;
+    return (events != NULL && events_gpio_watch(events, gpio_num, edge) == ESP_OK) ? 0 : -1;
+}
+
+static int gpio_unwatch(int gpio_num)
+{
+    events_ctx_t* events = t_instance->events;
+    return (events != NULL && events_gpio_unwatch(events, gpio_num) == ESP_OK) ? 0 : -1;
+}
+
+static int event_post(int id, int value)
+{
+    events_ctx_t* events = t_instance->events;
+    return (events != NULL && events_post(events, id, value) == ESP_OK) ? 0 : -1;
+}
+
+static void event_loop_exit(void)
+{
+    t_instance->event_loop_exit = true;
+}
+
+/* Checkpoints: checkpoint() saves the linear memory and globals of the module.
+ * The next time the same module runs, they are restored and its exported
+ * resume() function is called instead of _start.
+ */
+static bool s_boot_time_logged;
+
+static int checkpoint(void)
+{
+    trace_scope trace("checkpoint");
+    wasm_instance* inst = t_instance;
+    if (!instance_owns_checkpoints(inst)) {
+        ESP_LOGW(TAG, "A newer run owns the checkpoint now");
+        return -1;
+    }
+    if (inst->m3_module->numGlobals > CHECKPOINT_MAX_GLOBALS) {
+        ESP_LOGE(TAG, "Module has %d globals, checkpoints support up to %d",
+                 inst->m3_module->numGlobals, CHECKPOINT_MAX_GLOBALS);
+        return -1;
+    }
+    uint64_t globals[CHECKPOINT_MAX_GLOBALS];
+    for (uint32_t i = 0; i < inst->m3_module->numGlobals; ++i) {
+        globals[i] = inst->m3_module->globals[i].i64Value;
+    }
+    uint32_t memory_size = 0;
+    uint8_t* memory = m3_GetMemory(inst->m3_runtime, &memory_size, 0);
+    /* after a resume, keep reporting how long the original cold start took */
+    uint32_t cold_start_ms = inst->resumed ? inst->cold_start_ms :
+                             (uint32_t) ((esp_timer_get_time() - inst->start_time_us) / 1000);
+    esp_err_t err = checkpoint_save(inst->module_hash, memory, memory_size, globals,
+                                    inst->m3_module->numGlobals, cold_start_ms);
+    return (err == ESP_OK) ? 0 : -1;
+}
+
+/* Returns false if there is no checkpoint this module can resume from */
+static bool restore_checkpoint(wasm_instance* inst)
+{
+    checkpoint_info_t info;
+    IM3Function resume_fn;
+    if (!checkpoint_find(inst->module_hash, &info) ||
+            m3_FindFunction(&resume_fn, inst->m3_runtime, "resume") != m3Err_none) {
+        return false;
+    }
+    uint32_t pages = info.memory_size / d_m3MemPageSize;
+    if (info.global_count != inst->m3_module->numGlobals || info.memory_size % d_m3MemPageSize != 0 ||
+            inst->m3_runtime->memory.numPages > pages) {
+        ESP_LOGW(TAG, "Checkpoint doesn't match the module, starting from _start");
+        return false;
+    }
+
+    trace_scope trace("checkpoint_restore");
+    int64_t start = esp_timer_get_time();
+    if (inst->m3_runtime->memory.numPages < pages) {
+        M3Result result = ResizeMemory(inst->m3_runtime, pages);
+        if (result != m3Err_none) {
+            throw std::runtime_error(result);
+        }
+    }
+    uint32_t memory_size = 0;
+    uint8_t* memory = m3_GetMemory(inst->m3_runtime, &memory_size, 0);
+    uint64_t globals[CHECKPOINT_MAX_GLOBALS];
+    if (checkpoint_restore(memory, memory_size, globals, info.global_count) != ESP_OK) {
+        /* linear memory may be partly overwritten, neither entry point is safe to call now */
+        checkpoint_discard();
+        throw std::runtime_error("Failed to restore checkpoint");
+    }
+    for (uint32_t i = 0; i < info.global_count; ++i) {
+        inst->m3_module->globals[i].i64Value = globals[i];
+    }
+    inst->cold_start_ms = info.cold_start_ms;
+    ESP_LOGI(TAG, "Restored %d kB checkpoint in %d ms, cold start took %d ms to reach it",
+             memory_size / 1024, (int) ((esp_timer_get_time() - start) / 1000), info.cold_start_ms);
+    return true;
+}
+
+/* Assets API: read-only data from the assets partition, copied from flash
+ * straight into a guest buffer.
+ */
+static bool guest_range_valid(const void* ptr, size_t size)
+{
+    uint32_t memory_size = 0;
+    const uint8_t* memory = m3_GetMemory(t_instance->m3_runtime, &memory_size, 0);
+    const uint8_t* p = (const uint8_t*) ptr;
+    return p >= memory && p <= memory + memory_size && size <= (size_t) (memory + memory_size - p);
+}
+
+/* true if a zero-terminated string starts at ptr and ends inside linear memory */
+static bool guest_string_valid(const void* ptr)
+{
+    uint32_t memory_size = 0;
+    const uint8_t* memory = m3_GetMemory(t_instance->m3_runtime, &memory_size, 0);
+    const uint8_t* str = (const uint8_t*) ptr;
+    return guest_range_valid(str, 1) && memchr(str, 0, memory + memory_size - str) != NULL;
+}
+
+static int asset_open(const void* name)
+{
+    if (!guest_string_valid(name)) {
+        return -1;
+    }
+    int handle;
+    return (assets_open((const char*) name, &handle) == ESP_OK) ? handle : -1;
+}
+
+static int asset_size(int handle)
+{
+    size_t size;
+    return (assets_size(handle, &size) == ESP_OK) ? (int) size : -1;
+}
+
+static int asset_read_at(int handle, void* buf, int offset, int size)
+{
+    if (offset < 0 || size < 0 || !guest_range_valid(buf, size)) {
+        return -1;
+    }
+    trace_scope trace("asset_read", "offset", offset, "size", size);
+    size_t bytes_read = 0;
+    return (assets_read(handle, offset, buf, size, &bytes_read) == ESP_OK) ? (int) bytes_read : -1;
+}
+
+static int asset_prefetch(int handle, int offset, int size)
+{
+    if (offset < 0 || size < 0) {
+        return -1;
+    }
+    return (int) assets_prefetch(handle, offset, size);
+}
+
+/* Channels API: messages between modules running at the same time. Each module
+ * opens its end of a channel by name, mode 1 to send and 2 to receive. A negative
+ * timeout waits forever, zero doesn't wait. The calls return -1 on errors and once
+ * the other side has closed the channel, and CHANNEL_TIMED_OUT if the timeout expires.
+ */
+#define CHANNEL_TIMED_OUT   (-2)
+
+static bool channel_owned(int handle)
+{
+    return handle >= 0 && handle < 32 && (t_instance->channels & (1u << handle));
 }
 
-static void wasm_ext_init(wasm3::module &mod)
+static uint32_t channel_timeout(int timeout_ms)
+{
+    return (timeout_ms < 0) ? CHANNEL_WAIT_FOREVER : (uint32_t) timeout_ms;
+}
+
+/* true if a module of the run, other than the ones which opened an end of the
+ * channel already, is still running and may open its other end
+ */
+static bool channel_may_open(const char* name, void* arg)
+{
+    uint32_t run_id = *(const uint32_t*) arg;
+    for (wasm_instance* inst : s_instances) {
+        if (inst->run_id == run_id && inst->opened_channels.count(name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* must be called with s_instances_mutex held */
+static void close_unopened_channels(uint32_t run_id)
+{
+    channels_close_unopened(run_id, channel_may_open, &run_id);
+}
+
+static int channel_open(const void* name, int mode, int msg_size, int capacity)
+{
+    if (!guest_string_valid(name) || msg_size < 0 || capacity < 0) {
+        return -1;
+    }
+    wasm_instance* inst = t_instance;
+    int handle;
+    esp_err_t err = channels_open(inst->run_id, (const char*) name, (channel_mode_t) mode, msg_size, capacity, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to open channel %s (0x%x)", (const char*) name, err);
+        return -1;
+    }
+    inst->channels |= 1u << handle;
+    {
+        /* no module of the run may be left to open the other end */
+        std::lock_guard<std::mutex> lock(s_instances_mutex);
+        inst->opened_channels.insert((const char*) name);
+        close_unopened_channels(inst->run_id);
+    }
+    return handle;
+}
+
+static int channel_send(int handle, const void* buf, int size, int timeout_ms)
+{
+    if (!channel_owned(handle) || size < 0 || !guest_range_valid(buf, size)) {
+        return -1;
+    }
+    esp_err_t err = channels_send(handle, buf, size, channel_timeout(timeout_ms));
+    return (err == ESP_OK) ? 0 : (err == ESP_ERR_TIMEOUT) ? CHANNEL_TIMED_OUT : -1;
+}
+
+static int channel_recv(int handle, void* buf, int size, int timeout_ms)
+{
+    if (!channel_owned(handle) || size < 0 || !guest_range_valid(buf, size)) {
+        return -1;
+    }
+    size_t received = 0;
+    esp_err_t err = channels_receive(handle, buf, size, &received, channel_timeout(timeout_ms));
+    return (err == ESP_OK) ? (int) received : (err == ESP_ERR_TIMEOUT) ? CHANNEL_TIMED_OUT : -1;
+}
+
+static void channel_close(int handle)
+{
+    if (channel_owned(handle)) {
+        channels_close(handle);
+        t_instance->channels &= ~(1u << handle);
+    }
+}
+
+static void wasm_ext_init(wasm3::module &mod, bool primary)
 {
     /* link additional functions defined in this file */
     mod.link_optional("*", "delay_ms", delay_ms);
+    mod.link_optional("*", "timer_start", timer_start);
+    mod.link_optional("*", "timer_stop", timer_stop);
+    mod.link_optional("*", "gpio_watch", gpio_watch);
+    mod.link_optional("*", "gpio_unwatch", gpio_unwatch);
+    mod.link_optional("*", "event_post", event_post);
+    mod.link_optional("*", "event_loop_exit", event_loop_exit);
+    if (primary) {
+        /* the checkpoint partition can only serve one module */
+        mod.link_optional("*", "checkpoint", checkpoint);
+    }
+    mod.link_optional("*", "asset_open", asset_open);
+    mod.link_optional("*", "asset_size", asset_size);
+    mod.link_optional("*", "asset_read_at", asset_read_at);
+    mod.link_optional("*", "asset_prefetch", asset_prefetch);
+    mod.link_optional("*", "channel_open", channel_open);
+    mod.link_optional("*", "channel_send", channel_send);
+    mod.link_optional("*", "channel_recv", channel_recv);
+    mod.link_optional("*", "channel_close", channel_close);
 }
 
 /********************************************************************************/
 
 
-static std::string s_wasm_file_name;
-static size_t s_wasm_env_stack_size = 8 * 1024;
-
 class wasi_module: public wasm3::module
 {
 public:
     void link_wasi() {
         m3_LinkEspWASI(m_module.get());
     }
+    IM3Module get() {
+        return m_module.get();
+    }
+};
+
+class wasm_runtime: public wasm3::runtime
+{
+public:
+    IM3Runtime get() {
+        return m_runtime.get();
+    }
 };
 
+/* Fills the interpreter stack with a pattern and, once the runtime is done,
+ * reports how much of it has been overwritten. The wasm3 stack grows upwards.
+ */
+class env_stack_probe
+{
+public:
+    env_stack_probe(void* stack, size_t size, size_t* out_used)
+        : m_stack((uint8_t*) stack), m_size(size), m_out_used(out_used) {
+        memset(m_stack, STACK_PATTERN, m_size);
+    }
+    ~env_stack_probe() {
+        size_t used = m_size;
+        while (used > 0 && m_stack[used - 1] == STACK_PATTERN) {
+            --used;
+        }
+        *m_out_used = used;
+    }
+private:
+    static const uint8_t STACK_PATTERN = 0xa5;
+    uint8_t* m_stack;
+    size_t m_size;
+    size_t* m_out_used;
+};
+
+static void run_event_loop(wasm_instance* inst, wasm3::runtime &runtime)
+{
+    if (inst->events == NULL || inst->event_loop_exit || !events_pending(inst->events)) {
+        return;
+    }
+    wasm3::function on_event_fn = runtime.find_function("on_event");
+
+    /* the task blocks on the event queue, so it doesn't use any CPU time between events */
+    int64_t loop_start = esp_timer_get_time();
+    int64_t busy_us = 0;
+    event_t event;
+    while (!inst->event_loop_exit && events_pending(inst->events)) {
+        instance_activity(inst, GOVERNOR_ACTIVITY_RUN, false);
+        TRACE_BEGIN("event_wait");
+        bool got_event = events_wait(inst->events, &event, UINT32_MAX);
+        TRACE_END("event_wait");
+        instance_activity(inst, GOVERNOR_ACTIVITY_RUN, true);
+        if (!got_event) {
+            continue;
+        }
+        int64_t call_start = esp_timer_get_time();
+        {
+            trace_scope trace("on_event", "type", event.type, "id", event.id);
+            on_event_fn.call((int) event.type, (int) event.id, (int) event.value);
+        }
+        busy_us += esp_timer_get_time() - call_start;
+    }
+    int64_t loop_us = esp_timer_get_time() - loop_start;
+    ESP_LOGI(TAG, "Event loop done after %d ms, %d%% of it spent in on_event",
+             (int) (loop_us / 1000), (int) (loop_us ? busy_us * 100 / loop_us : 0));
+}
+
+/* Releases what the instance holds. Channel ends only this instance could still
+ * have opened are closed. The last instance to finish also frees the channels the
+ * modules left behind, and reports the totals of this run.
+ */
+static void instance_finish(wasm_instance* inst)
+{
+    for (int handle = 0; handle < 32; ++handle) {
+        if (inst->channels & (1u << handle)) {
+            channels_close(handle);
+        }
+    }
+    if (inst->events != NULL) {
+        events_destroy(inst->events);
+    }
+    instance_activity(inst, GOVERNOR_ACTIVITY_LOAD, false);
+    instance_activity(inst, GOVERNOR_ACTIVITY_RUN, false);
+    {
+        std::lock_guard<std::mutex> lock(s_instances_mutex);
+        s_instances.erase(std::find(s_instances.begin(), s_instances.end(), inst));
+        if (s_instances.empty()) {
+            channels_reset();
+            assets_log_stats();
+        } else {
+            close_unopened_channels(inst->run_id);
+        }
+    }
+    delete inst;
+}
+
 static void wasm_task(void* arg)
 {
-    std::cout << "Loading wasm file " << s_wasm_file_name.c_str() << std::endl;
+    wasm_instance* inst = (wasm_instance*) arg;
+    t_instance = inst;
+    std::cout << "Loading wasm file " << inst->file_name.c_str() << std::endl;
+    if (events_create(&inst->events) != ESP_OK) {
+        ESP_LOGW(TAG, "Too many modules running, events are not available to %s", inst->file_name.c_str());
+        inst->events = NULL;
+    }
 
+    size_t env_stack_used = 0;
+    stack_profile_result_t result = STACK_PROFILE_FAILED;
     try {
         wasm3::environment env;
-        wasm3::runtime runtime = env.new_runtime(s_wasm_env_stack_size);
-        std::ifstream wasm_file(s_wasm_file_name.c_str(), std::ios::binary | std::ios::in);
-        if (!wasm_file.is_open()) {
+        wasm3::runtime runtime = env.new_runtime(inst->env_stack_size);
+        env_stack_probe probe(((wasm_runtime*) &runtime)->get()->stack, inst->env_stack_size, &env_stack_used);
+        FILE* f = fopen(inst->file_name.c_str(), "rb");
+        if (f == NULL) {
             throw std::runtime_error("Failed to open wasm file");
         }
 
-        wasm3::module mod = env.parse_module(wasm_file);
-        runtime.load(mod);
-        ((wasi_module*) &mod)->link_wasi();  /* hack, this should be upstreamed to wasm3_cpp.h */
-        wasm_ext_init(mod);
+        /* compressed modules are decompressed on the fly while the parser reads them */
+        instance_activity(inst, GOVERNOR_ACTIVITY_LOAD, true);
+        int64_t load_start = esp_timer_get_time();
+        wasm_streambuf wasm_buf(f);
+        std::istream wasm_stream(&wasm_buf);
+        TRACE_BEGIN("wasm_parse");
+        wasm3::module mod = env.parse_module(wasm_stream);
+        TRACE_END("wasm_parse");
+        if (wasm_buf.failed()) {
+            throw std::runtime_error("Failed to read wasm file");
+        }
+        ESP_LOGI(TAG, "Loaded %s module: %d bytes read, %d bytes uncompressed, %d ms",
+                 wasm_format_name(wasm_buf.format()), wasm_buf.file_size(), wasm_buf.uncompressed_size(),
+                 (int) ((esp_timer_get_time() - load_start) / 1000));
+        {
+            trace_scope trace("wasm_load");
+            runtime.load(mod);
+            ((wasi_module*) &mod)->link_wasi();  /* hack, this should be upstreamed to wasm3_cpp.h */
+            wasm_ext_init(mod, inst->primary);
+        }
+        instance_activity(inst, GOVERNOR_ACTIVITY_RUN, true);
+        instance_activity(inst, GOVERNOR_ACTIVITY_LOAD, false);
 
-        wasm3::function start_fn = runtime.find_function("_start");
-        start_fn.call();
+        inst->m3_runtime = ((wasm_runtime*) &runtime)->get();
+        inst->m3_module = ((wasi_module*) &mod)->get();
+        inst->resumed = inst->primary && restore_checkpoint(inst);
+        wasm3::function start_fn = runtime.find_function(inst->resumed ? "resume" : "_start");
+        inst->start_time_us = esp_timer_get_time();
+        if (!s_boot_time_logged) {
+            /* esp_timer counts from the start of the app, the bootloader isn't included */
+            ESP_LOGI(TAG, "Boot to first instruction: %d ms", (int) (inst->start_time_us / 1000));
+            s_boot_time_logged = true;
+        }
+        try {
+            /* wasm3 compiles functions lazily, so this includes compiling the code main reaches */
+            trace_scope trace(inst->resumed ? "call_resume" : "call_start");
+            start_fn.call();
+        }
+        catch(std::runtime_error &e) {
+            /* returning from main may end in proc_exit, the event loop still has to run */
+            if (strcmp(e.what(), m3Err_trapExit) != 0) {
+                throw;
+            }
+        }
+        run_event_loop(inst, runtime);
+        result = STACK_PROFILE_COMPLETED;
     }
     catch(std::runtime_error &e) {
-        std::cerr << "WASM3 error: " << e.what() << std::endl;
+        if (strcmp(e.what(), m3Err_trapExit) == 0) {
+            /* proc_exit from on_event ends the module just like returning does */
+            result = STACK_PROFILE_COMPLETED;
+        } else {
+            std::cerr << "WASM3 error in " << inst->file_name.c_str() << ": " << e.what() << std::endl;
+            if (strcmp(e.what(), m3Err_trapStackOverflow) == 0) {
+                result = STACK_PROFILE_OVERFLOW;
+            }
+        }
+        if (result != STACK_PROFILE_COMPLETED && inst->resumed) {
+            /* don't resume into the same failure on every run */
+            ESP_LOGW(TAG, "Resumed module failed, dropping its checkpoint");
+            checkpoint_discard();
+        }
     }
+    inst->m3_runtime = NULL;
+    inst->m3_module = NULL;
 
+    if (instance_owns_checkpoints(inst)) {
+        /* on ESP-IDF the high water mark is in bytes */
+        stack_profile_t measured = {
+            .task_stack_used = (uint32_t) (inst->task_stack_size - uxTaskGetStackHighWaterMark(NULL)),
+            .env_stack_used = (uint32_t) env_stack_used,
+        };
+        stack_profile_update(inst->module_hash, &measured, result);
+    }
+    t_instance = NULL;
+    instance_finish(inst);
+
+    TRACE_THREAD_EXIT();
     vTaskDelete(NULL);
 }
 
-extern "C" void wasm_run(const char* wasm_file_name, size_t wasm_task_stack_size, size_t wasm_env_stack_size)
+extern "C" bool wasm_running(void)
+{
+    std::lock_guard<std::mutex> lock(s_instances_mutex);
+    return !s_instances.empty();
+}
+
+extern "C" void wasm_run(const char* const* wasm_file_names, const governor_level_t* run_levels, size_t count,
+                         size_t wasm_task_stack_size, size_t wasm_env_stack_size)
 {
-    s_wasm_file_name = wasm_file_name;
-    s_wasm_env_stack_size = wasm_env_stack_size;
-    xTaskCreate(wasm_task, "wasm_task", wasm_task_stack_size, NULL, 2, NULL);
+    std::vector<wasm_instance*> run;
+    for (size_t i = 0; i < count; ++i) {
+        wasm_instance* inst = new wasm_instance();
+        inst->file_name = wasm_file_names[i];
+        if (wasm_file_hash(wasm_file_names[i], &inst->module_hash) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read %s", wasm_file_names[i]);
+            delete inst;
+            continue;
+        }
+        inst->primary = run.empty();
+        inst->run_level = run_levels[i];
+        run.push_back(inst);
+    }
+    if (run.empty()) {
+        return;
+    }
+    {
+        /* all modules of the run are known before any of them starts, so none of
+         * them closes a channel end another one was about to open
+         */
+        std::lock_guard<std::mutex> lock(s_instances_mutex);
+        s_run_id++;
+        for (wasm_instance* inst : run) {
+            inst->run_id = s_run_id;
+            s_instances.push_back(inst);
+        }
+    }
+    for (wasm_instance* inst : run) {
+        size_t task_stack_size = wasm_task_stack_size;
+        size_t env_stack_size = wasm_env_stack_size;
+        if (inst->primary) {
+            /* sizes from settings are the upper limit, modules seen before get what they need */
+            stack_profile_apply(inst->module_hash, &task_stack_size, &env_stack_size);
+        }
+        inst->task_stack_size = task_stack_size;
+        inst->env_stack_size = env_stack_size;
+        if (xTaskCreate(wasm_task, "wasm_task", task_stack_size, inst, 2, NULL) != pdPASS) {
+            ESP_LOGE(TAG, "Not enough memory to run %s", inst->file_name.c_str());
+            instance_finish(inst);
+        }
+    }
 }
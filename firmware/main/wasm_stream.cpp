@@ -0,0 +1,543 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "esp_log.h"
+#include "esp32s2/rom/miniz.h"
+#include "wasm_stream.h"
+
+static const char* TAG = "wasm_stream";
+
+#define INPUT_BUF_SIZE      512
+#define PLAIN_WINDOW_SIZE   4096
+/* deflate back-references reach up to 32 KB, LZ4 ones up to 64 KB */
+#define GZIP_WINDOW_SIZE    TINFL_LZ_DICT_SIZE
+#define LZ4_WINDOW_SIZE     (64 * 1024)
+/* how much LZ4 output is produced per underflow() call */
+#define LZ4_CHUNK_SIZE      4096
+
+#define GZIP_FLAG_FHCRC     0x02
+#define GZIP_FLAG_FEXTRA    0x04
+#define GZIP_FLAG_FNAME     0x08
+#define GZIP_FLAG_FCOMMENT  0x10
+
+#define LZ4_FLG_VERSION_MASK    0xc0
+#define LZ4_FLG_VERSION         0x40
+#define LZ4_FLG_BLOCK_CHECKSUM  0x10
+#define LZ4_FLG_CONTENT_SIZE    0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID         0x01
+#define LZ4_BLOCK_UNCOMPRESSED  0x80000000u
+#define LZ4_FRAME_MAGIC         0x184D2204u
+
+extern "C" wasm_format_t wasm_detect_format(const uint8_t* hdr, size_t size)
+{
+    if (size >= 4 && hdr[0] == 0x00 && hdr[1] == 0x61 && hdr[2] == 0x73 && hdr[3] == 0x6d) {
+        return WASM_FORMAT_PLAIN;
+    }
+    if (size >= 3 && hdr[0] == 0x1f && hdr[1] == 0x8b && hdr[2] == 0x08) {
+        return WASM_FORMAT_GZIP;
+    }
+    if (size >= 4 && hdr[0] == 0x04 && hdr[1] == 0x22 && hdr[2] == 0x4d && hdr[3] == 0x18) {
+        return WASM_FORMAT_LZ4;
+    }
+    return WASM_FORMAT_UNKNOWN;
+}
+
+extern "C" const char* wasm_format_name(wasm_format_t format)
+{
+    switch (format) {
+    case WASM_FORMAT_PLAIN: return "wasm";
+    case WASM_FORMAT_GZIP: return "gzip";
+    case WASM_FORMAT_LZ4: return "lz4";
+    default: return "unknown";
+    }
+}
+
+extern "C" wasm_format_t wasm_file_format(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        return WASM_FORMAT_UNKNOWN;
+    }
+    uint8_t hdr[4];
+    size_t hdr_len = fread(hdr, 1, sizeof(hdr), f);
+    fclose(f);
+    return wasm_detect_format(hdr, hdr_len);
+}
+
+/* A gzip or LZ4 file is only a module if it decompresses to one, other archives
+ * copied to the drive are not picked up. Only the start of the file is decompressed.
+ */
+extern "C" wasm_format_t wasm_probe_file(const char* filename)
+{
+    wasm_format_t format = wasm_file_format(filename);
+    if (format == WASM_FORMAT_PLAIN || format == WASM_FORMAT_UNKNOWN) {
+        return format;
+    }
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        return WASM_FORMAT_UNKNOWN;
+    }
+    wasm_streambuf buf(f, true);
+    char magic[4];
+    if (buf.sgetn(magic, sizeof(magic)) != sizeof(magic) || buf.failed()) {
+        ESP_LOGW(TAG, "%s is not a module: %s", filename,
+                 buf.failed() ? buf.fail_reason() : "too short");
+        return WASM_FORMAT_UNKNOWN;
+    }
+    if (wasm_detect_format((const uint8_t*) magic, sizeof(magic)) != WASM_FORMAT_PLAIN) {
+        ESP_LOGW(TAG, "%s is not a module: %s archive of another file", filename, wasm_format_name(format));
+        return WASM_FORMAT_UNKNOWN;
+    }
+    return format;
+}
+
+/* FNV-1a over the file contents, identifies a module independently of its file name */
+extern "C" esp_err_t wasm_file_hash(const char* filename, uint32_t* out_hash)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint8_t* buf = (uint8_t*) malloc(INPUT_BUF_SIZE);
+    if (buf == NULL) {
+        fclose(f);
+        return ESP_ERR_NO_MEM;
+    }
+    uint32_t hash = 2166136261u;
+    size_t n;
+    while ((n = fread(buf, 1, INPUT_BUF_SIZE, f)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            hash = (hash ^ buf[i]) * 16777619u;
+        }
+    }
+    free(buf);
+    fclose(f);
+    *out_hash = hash;
+    return ESP_OK;
+}
+
+wasm_streambuf::wasm_streambuf(FILE* f, bool quiet) : m_file(f), m_quiet(quiet)
+{
+    m_in = (uint8_t*) malloc(INPUT_BUF_SIZE);
+    if (m_in == NULL) {
+        fail("out of memory");
+        return;
+    }
+    fill_input();
+    m_format = wasm_detect_format(m_in, m_in_len);
+
+    switch (m_format) {
+    case WASM_FORMAT_PLAIN:
+        m_window_size = PLAIN_WINDOW_SIZE;
+        break;
+    case WASM_FORMAT_GZIP:
+        m_window_size = GZIP_WINDOW_SIZE;
+        break;
+    case WASM_FORMAT_LZ4:
+        m_window_size = LZ4_WINDOW_SIZE;
+        break;
+    default:
+        fail("unknown file format");
+        return;
+    }
+    m_window = (uint8_t*) malloc(m_window_size);
+    if (m_window == NULL) {
+        fail("out of memory");
+        return;
+    }
+
+    if (m_format == WASM_FORMAT_GZIP) {
+        m_inflator = (tinfl_decompressor*) malloc(sizeof(tinfl_decompressor));
+        if (m_inflator == NULL) {
+            fail("out of memory");
+            return;
+        }
+        tinfl_init(m_inflator);
+        gzip_read_header();
+    } else if (m_format == WASM_FORMAT_LZ4) {
+        lz4_read_frame_header();
+    }
+}
+
+wasm_streambuf::~wasm_streambuf()
+{
+    free(m_inflator);
+    free(m_window);
+    free(m_in);
+    fclose(m_file);
+}
+
+void wasm_streambuf::fail(const char* reason)
+{
+    if (!m_failed) {
+        if (m_quiet) {
+            ESP_LOGD(TAG, "Failed to read %s module: %s (at input offset %d)",
+                     wasm_format_name(m_format), reason, m_in_total - (m_in_len - m_in_pos));
+        } else {
+            ESP_LOGE(TAG, "Failed to read %s module: %s (at input offset %d)",
+                     wasm_format_name(m_format), reason, m_in_total - (m_in_len - m_in_pos));
+        }
+        m_fail_reason = reason;
+    }
+    m_failed = true;
+    m_lz4_state = LZ4_DONE;
+    m_inflate_done = true;
+}
+
+bool wasm_streambuf::fill_input()
+{
+    if (m_in_eof) {
+        return false;
+    }
+    size_t remaining = m_in_len - m_in_pos;
+    memmove(m_in, m_in + m_in_pos, remaining);
+    size_t n = fread(m_in + remaining, 1, INPUT_BUF_SIZE - remaining, m_file);
+    if (n == 0) {
+        m_in_eof = true;
+    }
+    m_in_pos = 0;
+    m_in_len = remaining + n;
+    m_in_total += n;
+    return n > 0;
+}
+
+int wasm_streambuf::read_byte()
+{
+    if (m_in_pos == m_in_len && !fill_input()) {
+        return -1;
+    }
+    return m_in[m_in_pos++];
+}
+
+bool wasm_streambuf::read_u32(uint32_t* out)
+{
+    uint32_t val = 0;
+    for (int i = 0; i < 4; ++i) {
+        int b = read_byte();
+        if (b < 0) {
+            return false;
+        }
+        val |= ((uint32_t) b) << (8 * i);
+    }
+    *out = val;
+    return true;
+}
+
+bool wasm_streambuf::skip_bytes(size_t count)
+{
+    while (count--) {
+        if (read_byte() < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+wasm_streambuf::int_type wasm_streambuf::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    if (m_failed) {
+        return traits_type::eof();
+    }
+
+    /* plain files are read straight into the start of the window */
+    size_t start = (m_format == WASM_FORMAT_PLAIN) ? 0 : m_out_pos;
+    size_t produced;
+    switch (m_format) {
+    case WASM_FORMAT_PLAIN:
+        produced = plain_read();
+        break;
+    case WASM_FORMAT_GZIP:
+        produced = gzip_decompress();
+        break;
+    case WASM_FORMAT_LZ4:
+        produced = lz4_decompress();
+        break;
+    default:
+        produced = 0;
+        break;
+    }
+    if (produced == 0) {
+        return traits_type::eof();
+    }
+    m_out_total += produced;
+    m_out_pos = (start + produced) % m_window_size;
+
+    char* base = (char*) m_window + start;
+    setg(base, base, base + produced);
+    return traits_type::to_int_type(*gptr());
+}
+
+size_t wasm_streambuf::plain_read()
+{
+    /* header bytes consumed by the format check are still in the input buffer */
+    size_t produced = 0;
+    if (m_in_pos < m_in_len) {
+        produced = m_in_len - m_in_pos;
+        memcpy(m_window, m_in + m_in_pos, produced);
+        m_in_pos = m_in_len;
+    }
+    size_t n = fread(m_window + produced, 1, m_window_size - produced, m_file);
+    m_in_total += n;
+    return produced + n;
+}
+
+bool wasm_streambuf::gzip_read_header()
+{
+    uint8_t hdr[10];
+    for (int i = 0; i < 10; ++i) {
+        int b = read_byte();
+        if (b < 0) {
+            fail("truncated gzip header");
+            return false;
+        }
+        hdr[i] = b;
+    }
+    uint8_t flags = hdr[3];
+    if (flags & GZIP_FLAG_FEXTRA) {
+        int lo = read_byte();
+        int hi = read_byte();
+        if (lo < 0 || hi < 0 || !skip_bytes(lo | (hi << 8))) {
+            fail("truncated gzip extra field");
+            return false;
+        }
+    }
+    for (uint8_t zero_terminated : {GZIP_FLAG_FNAME, GZIP_FLAG_FCOMMENT}) {
+        if (flags & zero_terminated) {
+            int b;
+            do {
+                b = read_byte();
+            } while (b > 0);
+            if (b < 0) {
+                fail("truncated gzip header");
+                return false;
+            }
+        }
+    }
+    if ((flags & GZIP_FLAG_FHCRC) && !skip_bytes(2)) {
+        fail("truncated gzip header");
+        return false;
+    }
+    return true;
+}
+
+size_t wasm_streambuf::gzip_decompress()
+{
+    while (!m_inflate_done) {
+        if (m_in_pos == m_in_len) {
+            fill_input();
+        }
+        size_t in_size = m_in_len - m_in_pos;
+        size_t out_size = m_window_size - m_out_pos;
+        mz_uint32 flags = m_in_eof ? 0 : TINFL_FLAG_HAS_MORE_INPUT;
+        tinfl_status status = tinfl_decompress(m_inflator, m_in + m_in_pos, &in_size,
+                                               m_window, m_window + m_out_pos, &out_size, flags);
+        m_in_pos += in_size;
+
+        if (status == TINFL_STATUS_DONE) {
+            /* the CRC32 and ISIZE trailer is not checked, the wasm parser validates the module */
+            m_inflate_done = true;
+        } else if (status == TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS ||
+                   (status == TINFL_STATUS_NEEDS_MORE_INPUT && m_in_eof)) {
+            /* without TINFL_FLAG_HAS_MORE_INPUT, running out of input is reported as an error */
+            fail("truncated deflate stream");
+            return 0;
+        } else if (status < TINFL_STATUS_DONE) {
+            fail("corrupted deflate stream");
+            return 0;
+        }
+        if (out_size > 0) {
+            return out_size;
+        }
+    }
+    return 0;
+}
+
+bool wasm_streambuf::lz4_read_frame_header()
+{
+    uint32_t magic;
+    if (!read_u32(&magic)) {
+        /* clean end of file after the last frame */
+        m_lz4_state = LZ4_DONE;
+        return false;
+    }
+    if (magic != LZ4_FRAME_MAGIC) {
+        fail("bad LZ4 frame magic");
+        return false;
+    }
+    int flg = read_byte();
+    int bd = read_byte();
+    if (flg < 0 || bd < 0) {
+        fail("truncated LZ4 frame header");
+        return false;
+    }
+    if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION) {
+        fail("unsupported LZ4 frame version");
+        return false;
+    }
+    if (flg & LZ4_FLG_DICT_ID) {
+        fail("LZ4 dictionaries are not supported");
+        return false;
+    }
+    m_lz4_block_checksum = (flg & LZ4_FLG_BLOCK_CHECKSUM) != 0;
+    m_lz4_content_checksum = (flg & LZ4_FLG_CONTENT_CHECKSUM) != 0;
+    /* content size (optional) and header checksum byte are not needed */
+    size_t skip = ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + 1;
+    if (!skip_bytes(skip)) {
+        fail("truncated LZ4 frame header");
+        return false;
+    }
+    m_lz4_state = LZ4_BLOCK_HEADER;
+    return true;
+}
+
+int wasm_streambuf::lz4_block_byte()
+{
+    if (m_lz4_block_left == 0) {
+        fail("LZ4 sequence crosses block boundary");
+        return -1;
+    }
+    int b = read_byte();
+    if (b < 0) {
+        fail("truncated LZ4 block");
+        return -1;
+    }
+    m_lz4_block_left--;
+    return b;
+}
+
+size_t wasm_streambuf::lz4_decompress()
+{
+    const size_t mask = m_window_size - 1;
+    const size_t start = m_out_pos;
+    const size_t limit = std::min(start + LZ4_CHUNK_SIZE, m_window_size);
+    size_t pos = start;
+
+    /* Matches are resolved through the window, which always holds the
+     * last 64 KB of output, so linked blocks are handled as well. */
+    while (pos < limit && m_lz4_state != LZ4_DONE) {
+        switch (m_lz4_state) {
+        case LZ4_BLOCK_HEADER: {
+            uint32_t block_size;
+            if (!read_u32(&block_size)) {
+                fail("truncated LZ4 frame");
+                break;
+            }
+            if (block_size == 0) {
+                if (m_lz4_content_checksum && !skip_bytes(4)) {
+                    fail("truncated LZ4 content checksum");
+                    break;
+                }
+                /* the file may contain several concatenated frames */
+                lz4_read_frame_header();
+                break;
+            }
+            m_lz4_block_left = block_size & ~LZ4_BLOCK_UNCOMPRESSED;
+            m_lz4_state = (block_size & LZ4_BLOCK_UNCOMPRESSED) ? LZ4_RAW_BLOCK : LZ4_TOKEN;
+            break;
+        }
+        case LZ4_TOKEN: {
+            if (m_lz4_block_left == 0) {
+                if (m_lz4_block_checksum && !skip_bytes(4)) {
+                    fail("truncated LZ4 block checksum");
+                    break;
+                }
+                m_lz4_state = LZ4_BLOCK_HEADER;
+                break;
+            }
+            int token = lz4_block_byte();
+            if (token < 0) {
+                break;
+            }
+            uint32_t literals = token >> 4;
+            if (literals == 15) {
+                int b;
+                do {
+                    b = lz4_block_byte();
+                    literals += (b > 0) ? b : 0;
+                } while (b == 255);
+                if (b < 0) {
+                    break;
+                }
+            }
+            m_lz4_literals_left = literals;
+            m_lz4_match_nibble = token & 0x0f;
+            m_lz4_state = LZ4_LITERALS;
+            break;
+        }
+        case LZ4_LITERALS: {
+            if (m_lz4_literals_left > 0) {
+                int b = lz4_block_byte();
+                if (b < 0) {
+                    break;
+                }
+                m_window[pos++] = b;
+                m_lz4_literals_left--;
+                break;
+            }
+            if (m_lz4_block_left == 0) {
+                /* last sequence of the block has no match part */
+                m_lz4_state = LZ4_TOKEN;
+                break;
+            }
+            int lo = lz4_block_byte();
+            int hi = lz4_block_byte();
+            if (lo < 0 || hi < 0) {
+                break;
+            }
+            uint32_t offset = lo | (hi << 8);
+            if (offset == 0 || offset > m_out_total + (pos - start)) {
+                fail("invalid LZ4 match offset");
+                break;
+            }
+            uint32_t match_len = m_lz4_match_nibble;
+            if (match_len == 15) {
+                int b;
+                do {
+                    b = lz4_block_byte();
+                    match_len += (b > 0) ? b : 0;
+                } while (b == 255);
+                if (b < 0) {
+                    break;
+                }
+            }
+            m_lz4_match_offset = offset;
+            m_lz4_match_left = match_len + 4;
+            m_lz4_state = LZ4_MATCH;
+            break;
+        }
+        case LZ4_MATCH:
+            while (m_lz4_match_left > 0 && pos < limit) {
+                m_window[pos] = m_window[(pos - m_lz4_match_offset) & mask];
+                pos++;
+                m_lz4_match_left--;
+            }
+            if (m_lz4_match_left == 0) {
+                m_lz4_state = LZ4_TOKEN;
+            }
+            break;
+        case LZ4_RAW_BLOCK: {
+            if (m_lz4_block_left == 0) {
+                if (m_lz4_block_checksum && !skip_bytes(4)) {
+                    fail("truncated LZ4 block checksum");
+                    break;
+                }
+                m_lz4_state = LZ4_BLOCK_HEADER;
+                break;
+            }
+            int b = lz4_block_byte();
+            if (b < 0) {
+                break;
+            }
+            m_window[pos++] = b;
+            break;
+        }
+        case LZ4_DONE:
+            break;
+        }
+    }
+    return m_failed ? 0 : pos - start;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <streambuf>
+#include "common.h"
+
+struct tinfl_decompressor_tag;
+
+/* std::streambuf which produces the contents of a .wasm, .wasm.gz or .wasm.lz4 file.
+ * Compressed files are decompressed on the fly through a small fixed window,
+ * so the whole compressed file is never held in memory next to the module.
+ */
+class wasm_streambuf: public std::streambuf
+{
+public:
+    /* quiet: errors are expected, e.g. when probing, and logged at debug level */
+    explicit wasm_streambuf(FILE* f, bool quiet = false);
+    ~wasm_streambuf();
+
+    wasm_streambuf(const wasm_streambuf&) = delete;
+    wasm_streambuf& operator=(const wasm_streambuf&) = delete;
+
+    wasm_format_t format() const { return m_format; }
+    bool failed() const { return m_failed; }
+    const char* fail_reason() const { return m_fail_reason; }
+    size_t file_size() const { return m_in_total; }
+    size_t uncompressed_size() const { return m_out_total; }
+
+protected:
+    int_type underflow() override;
+
+private:
+    enum lz4_state_t {
+        LZ4_BLOCK_HEADER,
+        LZ4_TOKEN,
+        LZ4_LITERALS,
+        LZ4_MATCH,
+        LZ4_RAW_BLOCK,
+        LZ4_DONE,
+    };
+
+    bool fill_input();
+    int read_byte();
+    bool read_u32(uint32_t* out);
+    bool skip_bytes(size_t count);
+    void fail(const char* reason);
+
+    bool gzip_read_header();
+    size_t gzip_decompress();
+    bool lz4_read_frame_header();
+    int lz4_block_byte();
+    size_t lz4_decompress();
+    size_t plain_read();
+
+    FILE* m_file;
+    bool m_quiet;
+    wasm_format_t m_format = WASM_FORMAT_UNKNOWN;
+    bool m_failed = false;
+    const char* m_fail_reason = nullptr;
+
+    uint8_t* m_in = nullptr;
+    size_t m_in_pos = 0;
+    size_t m_in_len = 0;
+    bool m_in_eof = false;
+    size_t m_in_total = 0;
+
+    /* output window; for gzip and lz4 this is also the back-reference dictionary */
+    uint8_t* m_window = nullptr;
+    size_t m_window_size = 0;
+    size_t m_out_pos = 0;
+    size_t m_out_total = 0;
+
+    tinfl_decompressor_tag* m_inflator = nullptr;
+    bool m_inflate_done = false;
+
+    lz4_state_t m_lz4_state = LZ4_DONE;
+    bool m_lz4_block_checksum = false;
+    bool m_lz4_content_checksum = false;
+    uint32_t m_lz4_block_left = 0;
+    uint32_t m_lz4_literals_left = 0;
+    uint32_t m_lz4_match_left = 0;
+    uint32_t m_lz4_match_offset = 0;
+    uint8_t m_lz4_match_nibble = 0;
+};
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "esp_err.h"
+#include "ff.h"
+
+esp_err_t ff_diskio_get_drive(BYTE* out_pdrv);
+void ff_diskio_unregister(BYTE pdrv);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "esp_err.h"
+#include "ff.h"
+#include "wear_levelling.h"
+
+esp_err_t ff_diskio_register_wl_partition(BYTE pdrv, wl_handle_t handle);
+void ff_diskio_clear_pdrv_wl(wl_handle_t handle);
@@ -0,0 +1,100 @@
+#pragma once
+
+/* The tinfl subset of the ROM miniz that wasm_stream.cpp uses, implemented with the
+ * host's zlib. The decompressor keeps its own window, so output simply goes to
+ * out_next, which is all the ROM version does with a wrapping output buffer too.
+ * zlib's allocations come from an arena inside the decompressor, so freeing the
+ * decompressor frees everything, as with the ROM version.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t mz_uint8;
+typedef uint32_t mz_uint32;
+
+#define TINFL_LZ_DICT_SIZE          32768
+#define TINFL_FLAG_HAS_MORE_INPUT   2
+
+typedef enum {
+    TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+typedef struct tinfl_decompressor_tag {
+    z_stream stream;
+    int initialized;
+    size_t arena_used;
+    /* inflate state and its 32 KB window */
+    unsigned char arena[64 * 1024];
+} tinfl_decompressor;
+
+static inline voidpf tinfl_stub_alloc(voidpf opaque, uInt items, uInt size)
+{
+    tinfl_decompressor* r = (tinfl_decompressor*) opaque;
+    size_t bytes = ((size_t) items * size + 15) & ~(size_t) 15;
+    if (r->arena_used + bytes > sizeof(r->arena)) {
+        return Z_NULL;
+    }
+    voidpf p = r->arena + r->arena_used;
+    r->arena_used += bytes;
+    return p;
+}
+
+static inline void tinfl_stub_free(voidpf opaque, voidpf address)
+{
+}
+
+static inline void tinfl_init(tinfl_decompressor* r)
+{
+    r->initialized = 0;
+    r->arena_used = 0;
+}
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor* r, const mz_uint8* in_buf, size_t* in_size,
+                                            mz_uint8* out_start, mz_uint8* out_next, size_t* out_size,
+                                            const mz_uint32 flags)
+{
+    (void) out_start;
+    if (!r->initialized) {
+        r->stream.zalloc = tinfl_stub_alloc;
+        r->stream.zfree = tinfl_stub_free;
+        r->stream.opaque = r;
+        r->stream.next_in = Z_NULL;
+        r->stream.avail_in = 0;
+        if (inflateInit2(&r->stream, -15) != Z_OK) {
+            return TINFL_STATUS_FAILED;
+        }
+        r->initialized = 1;
+    }
+    r->stream.next_in = (Bytef*) in_buf;
+    r->stream.avail_in = (uInt) *in_size;
+    r->stream.next_out = out_next;
+    r->stream.avail_out = (uInt) *out_size;
+    int ret = inflate(&r->stream, Z_NO_FLUSH);
+    *in_size -= r->stream.avail_in;
+    *out_size -= r->stream.avail_out;
+    if (ret == Z_STREAM_END) {
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return TINFL_STATUS_FAILED;
+    }
+    if (r->stream.avail_out == 0) {
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    }
+    return (flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT
+                                               : TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Log lines go to a buffer, so tests can check what the firmware reports */
+void stub_log(const char* tag, const char* format, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define ESP_LOGE(tag, format, ...)  stub_log(tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  stub_log(tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  stub_log(tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  ((void) 0)
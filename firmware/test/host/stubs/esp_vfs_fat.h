@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/param.h>  /* MIN, MAX */
+#include "esp_err.h"
+#include "ff.h"
+
+esp_err_t esp_vfs_fat_register(const char* base_path, const char* fat_drive, size_t max_files, FATFS** out_fs);
+esp_err_t esp_vfs_fat_unregister_path(const char* base_path);
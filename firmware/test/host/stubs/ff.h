@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef unsigned char BYTE;
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+
+typedef enum {
+    FR_OK = 0,
+    FR_INT_ERR = 2,
+    FR_NO_FILESYSTEM = 13,
+} FRESULT;
+
+#define FM_FAT  0x01
+#define FM_SFD  0x08
+
+typedef struct {
+    BYTE pdrv;
+} FATFS;
+
+/* The tests don't go through the FATFS driver. Mounting succeeds unless
+ * stub_fat_set_no_filesystem() is set; then it fails even after f_mkfs(), which
+ * zeroes the first 64 KB of the volume.
+ */
+FRESULT f_mount(FATFS* fs, const char* path, BYTE opt);
+FRESULT f_mkfs(const char* path, BYTE opt, DWORD au, void* work, UINT len);
+void* ff_memalloc(UINT size);
+
+void stub_fat_set_no_filesystem(bool no_filesystem);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include "FreeRTOS.h"
+
+/* the tests are single threaded, the mutex only has to be non-NULL */
+typedef void* SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    static int s_mutex;
+    return &s_mutex;
+}
+
+static inline int xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    return pdTRUE;
+}
+
+static inline int xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return pdTRUE;
+}
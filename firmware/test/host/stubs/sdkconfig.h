@@ -0,0 +1,4 @@
+#pragma once
+
+#define CONFIG_ESP32S2_DEFAULT_CPU_FREQ_MHZ 240
+#define CONFIG_WL_SECTOR_SIZE 4096
@@ -0,0 +1,137 @@
+// Flash, wear levelling and FATFS functions storage.c uses. The volume is a
+// RAM image, and reads of it are counted so tests can tell cache hits apart.
+
+#include <stdlib.h>
+#include <string.h>
+#include "diskio_impl.h"
+#include "diskio_wl.h"
+#include "esp_vfs_fat.h"
+#include "wear_levelling.h"
+
+#define STUB_FLASH_SIZE     (1024 * 1024)
+
+static uint8_t s_flash[STUB_FLASH_SIZE];
+static uint32_t s_flash_reads;
+static FATFS s_fs;
+static bool s_no_filesystem;
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char* label)
+{
+    static const esp_partition_t s_partition = {
+        .type = ESP_PARTITION_TYPE_DATA,
+        .subtype = ESP_PARTITION_SUBTYPE_DATA_FAT,
+        .size = STUB_FLASH_SIZE,
+    };
+    return (type == s_partition.type && subtype == s_partition.subtype) ? &s_partition : NULL;
+}
+
+esp_err_t wl_mount(const esp_partition_t* partition, wl_handle_t* out_handle)
+{
+    *out_handle = 0;
+    return ESP_OK;
+}
+
+esp_err_t wl_read(wl_handle_t handle, size_t src_addr, void* dest, size_t size)
+{
+    if (src_addr + size > STUB_FLASH_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_flash_reads++;
+    memcpy(dest, s_flash + src_addr, size);
+    return ESP_OK;
+}
+
+esp_err_t wl_write(wl_handle_t handle, size_t dest_addr, const void* src, size_t size)
+{
+    if (dest_addr + size > STUB_FLASH_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(s_flash + dest_addr, src, size);
+    return ESP_OK;
+}
+
+esp_err_t wl_erase_range(wl_handle_t handle, size_t start_addr, size_t size)
+{
+    if (start_addr + size > STUB_FLASH_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(s_flash + start_addr, 0xff, size);
+    return ESP_OK;
+}
+
+size_t wl_size(wl_handle_t handle)
+{
+    return STUB_FLASH_SIZE;
+}
+
+size_t wl_sector_size(wl_handle_t handle)
+{
+    return CONFIG_WL_SECTOR_SIZE;
+}
+
+uint8_t* stub_flash_image(void)
+{
+    return s_flash;
+}
+
+size_t stub_flash_size(void)
+{
+    return STUB_FLASH_SIZE;
+}
+
+uint32_t stub_flash_reads(void)
+{
+    return s_flash_reads;
+}
+
+esp_err_t ff_diskio_get_drive(BYTE* out_pdrv)
+{
+    *out_pdrv = 0;
+    return ESP_OK;
+}
+
+void ff_diskio_unregister(BYTE pdrv)
+{
+}
+
+esp_err_t ff_diskio_register_wl_partition(BYTE pdrv, wl_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void ff_diskio_clear_pdrv_wl(wl_handle_t handle)
+{
+}
+
+esp_err_t esp_vfs_fat_register(const char* base_path, const char* fat_drive, size_t max_files, FATFS** out_fs)
+{
+    *out_fs = &s_fs;
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_unregister_path(const char* base_path)
+{
+    return ESP_OK;
+}
+
+FRESULT f_mount(FATFS* fs, const char* path, BYTE opt)
+{
+    return (fs != NULL && s_no_filesystem) ? FR_NO_FILESYSTEM : FR_OK;
+}
+
+FRESULT f_mkfs(const char* path, BYTE opt, DWORD au, void* work, UINT len)
+{
+    memset(s_flash, 0, 64 * 1024);
+    return FR_OK;
+}
+
+void stub_fat_set_no_filesystem(bool no_filesystem)
+{
+    s_no_filesystem = no_filesystem;
+}
+
+void* ff_memalloc(UINT size)
+{
+    return malloc(size);
+}
@@ -0,0 +1,138 @@
+// ESP-IDF functions governor.c uses, recorded so that tests can check them.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "stubs.h"
+
+#define STUB_MAX_TIMERS     4
+
+struct stub_pm_lock {
+    esp_pm_lock_type_t type;
+    int count;
+};
+
+struct stub_timer {
+    esp_timer_create_args_t args;
+    bool armed;
+    int64_t due_us;
+};
+
+static struct stub_pm_lock s_locks[3];
+static struct stub_timer s_timers[STUB_MAX_TIMERS];
+static int s_timer_count;
+static int64_t s_now_us;
+static char s_log[1024];
+
+void stub_log(const char* tag, const char* format, ...)
+{
+    size_t len = strlen(s_log);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(s_log + len, sizeof(s_log) - len, format, args);
+    va_end(args);
+}
+
+const char* stub_log_text(void)
+{
+    return s_log;
+}
+
+void stub_reset(void)
+{
+    memset(s_locks, 0, sizeof(s_locks));
+    memset(s_timers, 0, sizeof(s_timers));
+    s_timer_count = 0;
+    s_now_us = 0;
+    s_log[0] = 0;
+}
+
+void stub_clear_log(void)
+{
+    s_log[0] = 0;
+}
+
+esp_err_t esp_pm_configure(const void* config)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char* name, esp_pm_lock_handle_t* out_handle)
+{
+    s_locks[lock_type].type = lock_type;
+    *out_handle = &s_locks[lock_type];
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle)
+{
+    handle->count++;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle)
+{
+    if (handle->count == 0) {
+        return ESP_FAIL;
+    }
+    handle->count--;
+    return ESP_OK;
+}
+
+int stub_pm_lock_count(esp_pm_lock_type_t lock_type)
+{
+    return s_locks[lock_type].count;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return s_now_us;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* out_handle)
+{
+    if (s_timer_count == STUB_MAX_TIMERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    struct stub_timer* timer = &s_timers[s_timer_count++];
+    timer->args = *args;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    timer->armed = true;
+    timer->due_us = s_now_us + (int64_t) timeout_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    timer->armed = false;
+    return ESP_OK;
+}
+
+void stub_advance_us(int64_t us)
+{
+    int64_t end_us = s_now_us + us;
+    for (;;) {
+        struct stub_timer* next = NULL;
+        for (int i = 0; i < s_timer_count; ++i) {
+            if (s_timers[i].armed && s_timers[i].due_us <= end_us &&
+                    (next == NULL || s_timers[i].due_us < next->due_us)) {
+                next = &s_timers[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        s_now_us = next->due_us;
+        next->armed = false;
+        next->args.callback(next->args.arg);
+    }
+    s_now_us = end_us;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Test helpers of the stubbed ESP-IDF layer, see esp_pm.h and esp_timer.h for the rest */
+void stub_reset(void);
+void stub_clear_log(void);
+const char* stub_log_text(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int32_t wl_handle_t;
+
+#define WL_INVALID_HANDLE   -1
+
+esp_err_t wl_mount(const esp_partition_t* partition, wl_handle_t* out_handle);
+esp_err_t wl_read(wl_handle_t handle, size_t src_addr, void* dest, size_t size);
+esp_err_t wl_write(wl_handle_t handle, size_t dest_addr, const void* src, size_t size);
+esp_err_t wl_erase_range(wl_handle_t handle, size_t start_addr, size_t size);
+size_t wl_size(wl_handle_t handle);
+size_t wl_sector_size(wl_handle_t handle);
+
+/* The volume is a RAM image of stub_flash_size() bytes, in sectors of
+ * CONFIG_WL_SECTOR_SIZE. Tests can change it behind the firmware's back, like
+ * the FATFS driver does, and count the reads that reach it.
+ */
+uint8_t* stub_flash_image(void);
+size_t stub_flash_size(void);
+uint32_t stub_flash_reads(void);
+
+#ifdef __cplusplus
+}
+#endif
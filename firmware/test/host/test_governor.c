@@ -0,0 +1,192 @@
+// Host tests of the power governor: the policy, residency accounting, and the
+// PM locks governor.c takes for it, on top of a stubbed ESP-IDF layer.
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "stubs.h"
+#include "common.h"
+
+static int s_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            s_failures++; \
+        } \
+    } while (0)
+
+#define BIT(activity) GOVERNOR_ACTIVITY_BIT(GOVERNOR_ACTIVITY_ ## activity)
+
+static governor_level_t decide_level(uint32_t activities, bool usb_present, governor_level_t run_level)
+{
+    governor_config_t config = { .run_level = run_level, .light_sleep = false };
+    return governor_policy_decide(activities, usb_present, &config).level;
+}
+
+static void test_policy_activities(void)
+{
+    CHECK(decide_level(0, false, GOVERNOR_LEVEL_MAX) == GOVERNOR_LEVEL_LOW);
+    CHECK(decide_level(BIT(LOAD), false, GOVERNOR_LEVEL_LOW) == GOVERNOR_LEVEL_MAX);
+    CHECK(decide_level(BIT(USB_TRANSFER), false, GOVERNOR_LEVEL_LOW) == GOVERNOR_LEVEL_MAX);
+    CHECK(decide_level(BIT(FS), false, GOVERNOR_LEVEL_MAX) == GOVERNOR_LEVEL_APB);
+    CHECK(decide_level(BIT(COMMIT), false, GOVERNOR_LEVEL_MAX) == GOVERNOR_LEVEL_APB);
+    CHECK(decide_level(BIT(FS) | BIT(LOAD), false, GOVERNOR_LEVEL_LOW) == GOVERNOR_LEVEL_MAX);
+}
+
+static void test_policy_run_level(void)
+{
+    /* the run level only applies while guest code runs */
+    CHECK(decide_level(BIT(RUN), false, GOVERNOR_LEVEL_LOW) == GOVERNOR_LEVEL_LOW);
+    CHECK(decide_level(BIT(RUN), false, GOVERNOR_LEVEL_APB) == GOVERNOR_LEVEL_APB);
+    CHECK(decide_level(BIT(RUN), false, GOVERNOR_LEVEL_MAX) == GOVERNOR_LEVEL_MAX);
+    /* a low run level doesn't pull other activities down */
+    CHECK(decide_level(BIT(RUN) | BIT(COMMIT), false, GOVERNOR_LEVEL_LOW) == GOVERNOR_LEVEL_APB);
+    CHECK(decide_level(BIT(RUN) | BIT(LOAD), false, GOVERNOR_LEVEL_LOW) == GOVERNOR_LEVEL_MAX);
+}
+
+static void test_policy_usb(void)
+{
+    CHECK(decide_level(0, true, GOVERNOR_LEVEL_MAX) == GOVERNOR_LEVEL_APB);
+    CHECK(decide_level(BIT(RUN), true, GOVERNOR_LEVEL_LOW) == GOVERNOR_LEVEL_APB);
+    CHECK(decide_level(BIT(RUN), true, GOVERNOR_LEVEL_MAX) == GOVERNOR_LEVEL_MAX);
+    CHECK(decide_level(BIT(USB_TRANSFER), true, GOVERNOR_LEVEL_LOW) == GOVERNOR_LEVEL_MAX);
+}
+
+static void test_policy_light_sleep(void)
+{
+    governor_config_t config = { .run_level = GOVERNOR_LEVEL_LOW, .light_sleep = true };
+    CHECK(governor_policy_decide(0, false, &config).allow_light_sleep);
+    CHECK(governor_policy_decide(BIT(RUN), false, &config).allow_light_sleep);
+    CHECK(!governor_policy_decide(0, true, &config).allow_light_sleep);
+    CHECK(!governor_policy_decide(BIT(FS), false, &config).allow_light_sleep);
+    config.light_sleep = false;
+    CHECK(!governor_policy_decide(0, false, &config).allow_light_sleep);
+}
+
+static void test_residency(void)
+{
+    governor_residency_t residency;
+    governor_residency_init(&residency, GOVERNOR_LEVEL_LOW, 1000);
+    CHECK(governor_residency_total(&residency, 1000) == 0);
+
+    governor_residency_switch(&residency, GOVERNOR_LEVEL_MAX, 3000);
+    governor_residency_switch(&residency, GOVERNOR_LEVEL_MAX, 4000);  /* no change, not a transition */
+    governor_residency_switch(&residency, GOVERNOR_LEVEL_APB, 6000);
+    governor_residency_switch(&residency, GOVERNOR_LEVEL_LOW, 7000);
+    CHECK(residency.transitions == 3);
+    CHECK(governor_residency_time(&residency, GOVERNOR_LEVEL_LOW, 10000) == 2000 + 3000);
+    CHECK(governor_residency_time(&residency, GOVERNOR_LEVEL_MAX, 10000) == 3000);
+    CHECK(governor_residency_time(&residency, GOVERNOR_LEVEL_APB, 10000) == 1000);
+    CHECK(governor_residency_total(&residency, 10000) == 9000);
+}
+
+static void test_level_names(void)
+{
+    governor_level_t level;
+    CHECK(governor_level_from_name("apb", &level) && level == GOVERNOR_LEVEL_APB);
+    CHECK(!governor_level_from_name("fast", &level));
+    CHECK(strcmp(governor_level_name(GOVERNOR_LEVEL_MAX), "max") == 0);
+}
+
+static void check_locks(int cpu, int apb, int no_sleep)
+{
+    CHECK(stub_pm_lock_count(ESP_PM_CPU_FREQ_MAX) == cpu);
+    CHECK(stub_pm_lock_count(ESP_PM_APB_FREQ_MAX) == apb);
+    CHECK(stub_pm_lock_count(ESP_PM_NO_LIGHT_SLEEP) == no_sleep);
+}
+
+/* governor.c keeps its state across calls, so these run in order on one governor */
+static void test_governor_locks(void)
+{
+    stub_reset();
+    CHECK(governor_init() == ESP_OK);
+    governor_config_t config = { .run_level = GOVERNOR_LEVEL_MAX, .light_sleep = true };
+    governor_configure(&config);
+    check_locks(0, 0, 0);
+
+    /* the initial level is low, and all the time until the first switch is counted there */
+    stub_clear_log();
+    stub_advance_us(100 * 1000);
+    governor_log_residency();
+    CHECK(strstr(stub_log_text(), "residency over 100 ms, 0 transitions: low 100%") != NULL);
+
+    /* USB holds the bus clock up until it's gone, whatever else happens */
+    governor_set_usb_present(true);
+    check_locks(0, 1, 1);
+    governor_activity_begin(GOVERNOR_ACTIVITY_LOAD);
+    check_locks(1, 1, 1);
+    governor_activity_end(GOVERNOR_ACTIVITY_LOAD);
+    check_locks(0, 1, 1);
+    governor_set_usb_present(false);
+    check_locks(0, 0, 0);
+
+    /* two modules at the same level, the level stays until both have stopped running */
+    governor_run_begin(GOVERNOR_LEVEL_MAX);
+    governor_run_begin(GOVERNOR_LEVEL_MAX);
+    check_locks(1, 1, 1);
+    governor_run_end(GOVERNOR_LEVEL_MAX);
+    check_locks(1, 1, 1);
+    governor_run_end(GOVERNOR_LEVEL_MAX);
+    check_locks(0, 0, 0);
+
+    /* modules at different levels, the highest level of the running ones applies */
+    governor_run_begin(GOVERNOR_LEVEL_LOW);
+    check_locks(0, 0, 0);
+    governor_run_begin(GOVERNOR_LEVEL_APB);
+    check_locks(0, 1, 1);
+    governor_run_begin(GOVERNOR_LEVEL_MAX);
+    check_locks(1, 1, 1);
+    governor_run_end(GOVERNOR_LEVEL_MAX);
+    check_locks(0, 1, 1);
+    governor_run_end(GOVERNOR_LEVEL_APB);
+    check_locks(0, 0, 0);
+    governor_run_end(GOVERNOR_LEVEL_LOW);
+    governor_run_end(GOVERNOR_LEVEL_LOW);   /* unbalanced end is ignored */
+    governor_run_end(GOVERNOR_LEVEL_MAX);
+    check_locks(0, 0, 0);
+    governor_run_begin(GOVERNOR_LEVEL_APB);
+    check_locks(0, 1, 1);
+    governor_run_end(GOVERNOR_LEVEL_APB);
+    check_locks(0, 0, 0);
+
+    /* level transitions are logged, the per-decision detail isn't */
+    stub_clear_log();
+    governor_activity_begin(GOVERNOR_ACTIVITY_LOAD);
+    governor_activity_end(GOVERNOR_ACTIVITY_LOAD);
+    CHECK(strstr(stub_log_text(), "low -> max") != NULL);
+    CHECK(strstr(stub_log_text(), "max -> low") != NULL);
+    CHECK(strstr(stub_log_text(), "activities") == NULL);
+}
+
+static void test_governor_usb_transfer(void)
+{
+    /* continues on the governor set up by test_governor_locks() */
+    governor_usb_transfer();
+    check_locks(1, 1, 1);
+    stub_advance_us(150 * 1000);
+    governor_usb_transfer();
+    stub_advance_us(150 * 1000);
+    check_locks(1, 1, 1);   /* 200 ms after the last transfer only */
+    stub_advance_us(60 * 1000);
+    check_locks(0, 0, 0);
+}
+
+int main(void)
+{
+    test_policy_activities();
+    test_policy_run_level();
+    test_policy_usb();
+    test_policy_light_sleep();
+    test_residency();
+    test_level_names();
+    test_governor_locks();
+    test_governor_usb_transfer();
+    if (s_failures != 0) {
+        printf("%d checks failed\n", s_failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,232 @@
+// Host tests of the MSC read cache in storage.c: the FAT metadata region stays
+// resident, sequential reads are served from the read-ahead buffer, writes update
+// both copies, and the cache is dropped when the firmware mounts FAT.
+
+#include <stdio.h>
+#include <string.h>
+#include "stubs.h"
+#include "ff.h"
+#include "wear_levelling.h"
+#include "common.h"
+
+static int s_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            s_failures++; \
+        } \
+    } while (0)
+
+#define SECTOR          CONFIG_WL_SECTOR_SIZE
+/* the volume built by format_volume(): boot sector, two FATs of one sector, 512 root entries */
+#define FAT_SECTORS     1
+#define ROOT_SECTORS    (512 * 32 / SECTOR)
+#define META_SIZE       ((1 + 2 * FAT_SECTORS + ROOT_SECTORS) * SECTOR)
+#define READAHEAD_SIZE  (32 * 1024)
+
+/* the staging RAM disk is off in these tests */
+esp_err_t staging_recover(void) { return ESP_OK; }
+bool staging_active(void) { return false; }
+esp_err_t staging_register_diskio(uint8_t pdrv) { return ESP_FAIL; }
+esp_err_t staging_read(size_t addr, size_t size, void* dest) { return ESP_FAIL; }
+esp_err_t staging_write(size_t addr, size_t size, const void* src) { return ESP_FAIL; }
+
+static void put_le16(uint8_t* p, uint16_t val)
+{
+    p[0] = val & 0xff;
+    p[1] = val >> 8;
+}
+
+static void put_le32(uint8_t* p, uint32_t val)
+{
+    put_le16(p, val & 0xffff);
+    put_le16(p + 2, val >> 16);
+}
+
+/* fills the image with a pattern and puts a FAT boot sector at boot_offset */
+static void format_volume(size_t boot_offset)
+{
+    uint8_t* image = stub_flash_image();
+    for (size_t i = 0; i < stub_flash_size(); ++i) {
+        image[i] = (uint8_t) (i * 7 + i / SECTOR);
+    }
+    uint8_t* bs = image + boot_offset;
+    bs[0] = 0xeb;
+    put_le16(bs + 11, SECTOR);
+    put_le16(bs + 14, 1);           /* reserved sectors */
+    bs[16] = 2;                     /* FATs */
+    put_le16(bs + 17, 512);         /* root directory entries */
+    put_le16(bs + 22, FAT_SECTORS);
+    bs[510] = 0x55;
+    bs[511] = 0xaa;
+    if (boot_offset != 0) {
+        /* MBR with the first partition at the boot sector */
+        uint8_t* entry = image + 446;
+        entry[4] = 0x01;
+        put_le32(entry + 8, boot_offset / SECTOR);
+        image[510] = 0x55;
+        image[511] = 0xaa;
+    }
+}
+
+/* reads through storage_read_sector(), checks the data against the image and
+ * how many reads reached the flash
+ */
+static void check_read(size_t addr, size_t size, uint32_t flash_reads, int line)
+{
+    static uint8_t buf[READAHEAD_SIZE * 2];
+    uint32_t before = stub_flash_reads();
+    memset(buf, 0, size);
+    if (storage_read_sector(addr, size, buf) != ESP_OK) {
+        printf("%s:%d: read of %zu bytes at 0x%zx failed\n", __FILE__, line, size, addr);
+        s_failures++;
+    }
+    if (memcmp(buf, stub_flash_image() + addr, size) != 0) {
+        printf("%s:%d: data read at 0x%zx differs from the volume\n", __FILE__, line, addr);
+        s_failures++;
+    }
+    if (stub_flash_reads() - before != flash_reads) {
+        printf("%s:%d: read at 0x%zx took %u flash reads, expected %u\n", __FILE__, line, addr,
+               stub_flash_reads() - before, flash_reads);
+        s_failures++;
+    }
+}
+
+#define CHECK_READ(addr, size, flash_reads) check_read(addr, size, flash_reads, __LINE__)
+
+static void write_pattern(size_t addr, size_t size, uint8_t val)
+{
+    static uint8_t buf[READAHEAD_SIZE];
+    memset(buf, val, size);
+    CHECK(storage_write_sector(addr, size, buf) == ESP_OK);
+    CHECK(stub_flash_image()[addr] == val && stub_flash_image()[addr + size - 1] == val);
+}
+
+static void test_metadata_resident(void)
+{
+    format_volume(0);
+    /* the first read loads sector 0 and then the whole metadata region */
+    CHECK_READ(0, SECTOR, 2);
+    CHECK_READ(SECTOR, SECTOR, 0);                  /* first FAT */
+    CHECK_READ(3 * SECTOR, 2 * SECTOR, 0);          /* root directory */
+    CHECK_READ(0, META_SIZE, 0);
+    /* a read across the end of the region only reads the data part */
+    CHECK_READ(META_SIZE - SECTOR, 2 * SECTOR, 1);
+}
+
+static void test_readahead(void)
+{
+    const size_t data = 0x10000;
+    storage_cache_log_stats();                      /* resets the counters */
+    CHECK_READ(data, SECTOR, 1);                    /* not sequential, read directly */
+    CHECK_READ(data + SECTOR, SECTOR, 1);           /* sequential, fills the read-ahead buffer */
+    for (size_t addr = data + 2 * SECTOR; addr < data + SECTOR + READAHEAD_SIZE; addr += SECTOR) {
+        CHECK_READ(addr, SECTOR, 0);
+    }
+    CHECK_READ(data + SECTOR + READAHEAD_SIZE, SECTOR, 1);
+    CHECK_READ(data + 2 * SECTOR + READAHEAD_SIZE, 2 * SECTOR, 0);
+    /* a read as large as the buffer isn't worth prefetching */
+    CHECK_READ(data + 4 * SECTOR + READAHEAD_SIZE, READAHEAD_SIZE, 1);
+    CHECK_READ(0x80000, SECTOR, 1);
+
+    stub_clear_log();
+    storage_cache_log_stats();
+    CHECK(strstr(stub_log_text(), "(metadata 0, read-ahead 8), 2 prefetches, 3 misses") != NULL);
+}
+
+static void test_write_updates_cache(void)
+{
+    /* metadata and read-ahead copies are updated in place, no flash read to see the new data */
+    write_pattern(SECTOR, SECTOR, 0xa1);
+    CHECK_READ(SECTOR, SECTOR, 0);
+    write_pattern(4 * SECTOR, 2 * SECTOR, 0xa2);
+    CHECK_READ(3 * SECTOR, 4 * SECTOR, 0);
+
+    const size_t data = 0x40000;
+    CHECK_READ(data, SECTOR, 1);
+    CHECK_READ(data + SECTOR, SECTOR, 1);           /* read-ahead of [data + SECTOR, + 32 KB) */
+    write_pattern(data + 2 * SECTOR, SECTOR, 0xa3);
+    CHECK_READ(data + 2 * SECTOR, SECTOR, 0);
+    /* a write across the end of the buffer updates the part inside it */
+    write_pattern(data + READAHEAD_SIZE, 2 * SECTOR, 0xa4);
+    CHECK_READ(data + READAHEAD_SIZE, SECTOR, 0);
+    /* and one across the start of it */
+    write_pattern(data, 2 * SECTOR, 0xa5);
+    CHECK_READ(data + SECTOR, SECTOR, 0);
+
+    /* a new boot sector may change the layout, the region is loaded again */
+    static uint8_t bs[SECTOR];
+    memcpy(bs, stub_flash_image(), SECTOR);
+    bs[100] ^= 0xff;
+    CHECK(storage_write_sector(0, SECTOR, bs) == ESP_OK);
+    CHECK_READ(SECTOR, SECTOR, 2);
+    CHECK_READ(0, SECTOR, 0);
+}
+
+static void test_mount_invalidates(void)
+{
+    const size_t data = 0x60000;
+    CHECK_READ(SECTOR, SECTOR, 0);
+    CHECK_READ(data, SECTOR, 1);
+    CHECK_READ(data + SECTOR, SECTOR, 1);
+
+    /* the FATFS driver writes the volume directly, the cache doesn't see it */
+    CHECK(storage_mount_fat("/data") == ESP_OK);
+    CHECK(!storage_fat_formatted());
+    CHECK_READ(SECTOR, SECTOR, 1);                  /* bypassed while mounted */
+    memset(stub_flash_image() + SECTOR, 0xb1, SECTOR);
+    memset(stub_flash_image() + data + 2 * SECTOR, 0xb2, SECTOR);
+    CHECK(storage_write_sector(data, SECTOR, stub_flash_image()) == ESP_ERR_INVALID_STATE);
+    CHECK(storage_unmount_fat() == ESP_OK);
+
+    /* both copies were dropped, the new contents are read from flash */
+    CHECK_READ(SECTOR, SECTOR, 2);
+    CHECK_READ(data + 2 * SECTOR, SECTOR, 1);
+    CHECK_READ(data + 3 * SECTOR, SECTOR, 1);
+    CHECK_READ(data + 4 * SECTOR, SECTOR, 0);
+}
+
+static void test_failed_mount_invalidates(void)
+{
+    /* a mount which formats the volume and then fails still leaves the cache dropped */
+    CHECK_READ(SECTOR, SECTOR, 0);
+    stub_fat_set_no_filesystem(true);
+    CHECK(storage_mount_fat("/data") == ESP_FAIL);
+    stub_fat_set_no_filesystem(false);
+    CHECK(stub_flash_image()[SECTOR] == 0);
+    /* no boot sector anymore, only sector 0 is kept */
+    CHECK_READ(0, SECTOR, 2);
+    CHECK_READ(SECTOR, SECTOR, 1);
+    CHECK_READ(0, SECTOR, 0);
+}
+
+static void test_mbr_volume(void)
+{
+    /* the boot sector after an MBR, everything up to the end of its region stays resident */
+    format_volume(SECTOR);
+    CHECK(storage_mount_fat("/data") == ESP_OK);
+    CHECK(storage_unmount_fat() == ESP_OK);
+    CHECK_READ(0, SECTOR, 3);
+    CHECK_READ(SECTOR, SECTOR, 0);
+    CHECK_READ(SECTOR + META_SIZE - SECTOR, SECTOR, 0);
+    CHECK_READ(SECTOR + META_SIZE, SECTOR, 1);
+}
+
+int main(void)
+{
+    stub_reset();
+    CHECK(storage_init_wl() == ESP_OK);
+    test_metadata_resident();
+    test_readahead();
+    test_write_updates_cache();
+    test_mount_invalidates();
+    test_failed_mount_invalidates();
+    test_mbr_volume();
+    if (s_failures != 0) {
+        printf("%d checks failed\n", s_failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
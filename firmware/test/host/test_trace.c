@@ -0,0 +1,397 @@
+// Host tests of the trace recorder: several threads record while trace_dump()
+// writes the rings out, the output must be valid JSON, and events lost to full
+// rings or to threads without a ring must be counted.
+
+#define _GNU_SOURCE   /* pthread_setname_np */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+#define DUMP_PATH       "test_trace.json"
+#define RING_EVENTS     CONFIG_WASM_DEMO_TRACE_EVENTS
+#define MAX_THREADS     8   /* TRACE_MAX_THREADS in trace.c */
+
+static int s_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            s_failures++; \
+        } \
+    } while (0)
+
+/***** a minimal JSON parser, returns the end of the value or NULL if it's invalid *****/
+
+static const char* json_value(const char* p);
+
+static const char* json_space(const char* p)
+{
+    while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+static const char* json_string(const char* p)
+{
+    if (*p++ != '"') {
+        return NULL;
+    }
+    while (*p != '"') {
+        if (*p == 0 || (unsigned char) *p < 0x20) {
+            return NULL;
+        }
+        if (*p == '\\') {
+            p++;
+            if (*p == 0 || strchr("\"\\/bfnrtu", *p) == NULL) {
+                return NULL;
+            }
+        }
+        p++;
+    }
+    return p + 1;
+}
+
+static const char* json_number(const char* p)
+{
+    const char* start = p;
+    if (*p == '-') {
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    return (p == start || (p == start + 1 && *start == '-')) ? NULL : p;
+}
+
+/* parses the members of an object (with_keys) or the elements of an array */
+static const char* json_members(const char* p, char close, bool with_keys)
+{
+    p = json_space(p + 1);
+    if (*p == close) {
+        return p + 1;
+    }
+    while (p != NULL) {
+        if (with_keys) {
+            p = json_string(json_space(p));
+            if (p == NULL || *(p = json_space(p)) != ':') {
+                return NULL;
+            }
+            p++;
+        }
+        p = json_value(p);
+        if (p == NULL) {
+            return NULL;
+        }
+        p = json_space(p);
+        if (*p == close) {
+            return p + 1;
+        }
+        p = (*p == ',') ? p + 1 : NULL;
+    }
+    return NULL;
+}
+
+static const char* json_value(const char* p)
+{
+    p = json_space(p);
+    switch (*p) {
+    case '{': return json_members(p, '}', true);
+    case '[': return json_members(p, ']', false);
+    case '"': return json_string(p);
+    case 't': return strncmp(p, "true", 4) == 0 ? p + 4 : NULL;
+    case 'f': return strncmp(p, "false", 5) == 0 ? p + 5 : NULL;
+    case 'n': return strncmp(p, "null", 4) == 0 ? p + 4 : NULL;
+    default: return json_number(p);
+    }
+}
+
+static bool json_valid(const char* text)
+{
+    const char* end = json_value(text);
+    return end != NULL && *json_space(end) == 0;
+}
+
+/***** dump helpers *****/
+
+typedef struct {
+    int count;          /* returned by trace_dump() */
+    bool valid;         /* the file parses as JSON */
+    int events;         /* "B", "E" and "i" events in the file */
+    int dropped;        /* otherData.dropped_events */
+    char* text;
+} dump_t;
+
+static int count_substr(const char* text, const char* needle)
+{
+    int n = 0;
+    for (const char* p = strstr(text, needle); p != NULL; p = strstr(p + 1, needle)) {
+        n++;
+    }
+    return n;
+}
+
+static dump_t dump(void)
+{
+    dump_t d = { .dropped = -1 };
+    d.count = trace_dump(DUMP_PATH);
+    FILE* f = fopen(DUMP_PATH, "rb");
+    if (f == NULL) {
+        return d;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    d.text = calloc(1, size + 1);
+    if (fread(d.text, 1, size, f) != (size_t) size) {
+        d.text[0] = 0;
+    }
+    fclose(f);
+
+    d.valid = json_valid(d.text);
+    d.events = count_substr(d.text, "\"ph\":\"B\"") + count_substr(d.text, "\"ph\":\"E\"") +
+               count_substr(d.text, "\"ph\":\"i\"");
+    const char* dropped = strstr(d.text, "\"dropped_events\":");
+    if (dropped != NULL) {
+        d.dropped = atoi(dropped + strlen("\"dropped_events\":"));
+    }
+    return d;
+}
+
+/* the thread_name metadata event of a ring */
+static bool dump_has_thread(const dump_t* d, const char* name)
+{
+    char needle[48];
+    snprintf(needle, sizeof(needle), "\"args\":{\"name\":\"%s\"}", name);
+    return strstr(d->text, needle) != NULL;
+}
+
+/***** recording threads *****/
+
+typedef struct {
+    char name[16];
+    int events;                     /* to record after the first one */
+    pthread_barrier_t* recorded;    /* waited for after the first event, if set */
+    pthread_barrier_t* release;     /* waited for before exiting, if set */
+    atomic_bool* stop;              /* record pairs until set, instead of a fixed count */
+} worker_t;
+
+static void* worker_main(void* arg)
+{
+    worker_t* w = arg;
+    pthread_setname_np(pthread_self(), w->name);
+    TRACE_INSTANT("start", "n", w->events);
+    if (w->recorded != NULL) {
+        pthread_barrier_wait(w->recorded);
+    }
+    if (w->stop != NULL) {
+        for (int i = 0; !atomic_load(w->stop); ++i) {
+            TRACE_BEGIN_ARGS("work", "i", i, "n", w->events);
+            TRACE_END("work");
+        }
+    } else {
+        for (int i = 0; i < w->events; ++i) {
+            TRACE_INSTANT("work", "i", i);
+        }
+    }
+    if (w->release != NULL) {
+        pthread_barrier_wait(w->release);
+    }
+    TRACE_THREAD_EXIT();
+    return NULL;
+}
+
+static void start_worker(pthread_t* thread, worker_t* w, const char* name, int events)
+{
+    snprintf(w->name, sizeof(w->name), "%s", name);
+    w->events = events;
+    pthread_create(thread, NULL, worker_main, w);
+}
+
+/***** tests, they run in order: the rings are global and persist between them *****/
+
+static void test_record_and_dump(void)
+{
+    /* a few threads record concurrently, nothing is lost while the rings have room */
+    enum { THREADS = 4, EVENTS = RING_EVENTS / 2 };
+    pthread_t threads[THREADS];
+    worker_t workers[THREADS] = { 0 };
+    for (int i = 0; i < THREADS; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "rec %d", i);
+        start_worker(&threads[i], &workers[i], name, EVENTS);
+    }
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    dump_t d = dump();
+    CHECK(d.valid);
+    CHECK(d.count == THREADS * (1 + EVENTS));
+    CHECK(d.events == d.count);
+    CHECK(d.dropped == 0);
+    CHECK(dump_has_thread(&d, "rec 0") && dump_has_thread(&d, "rec 3"));
+    free(d.text);
+
+    /* nothing new since the last dump */
+    d = dump();
+    CHECK(d.valid && d.count == 0 && d.dropped == 0);
+    free(d.text);
+}
+
+static void test_dump_while_recording(void)
+{
+    /* the same names take over their rings, so no new ring is used */
+    enum { THREADS = 4, DUMPS = 50 };
+    pthread_t threads[THREADS];
+    worker_t workers[THREADS] = { 0 };
+    atomic_bool stop = false;
+    for (int i = 0; i < THREADS; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "rec %d", i);
+        workers[i].stop = &stop;
+        start_worker(&threads[i], &workers[i], name, 0);
+    }
+    for (int i = 0; i < DUMPS; ++i) {
+        dump_t d = dump();
+        CHECK(d.valid);
+        CHECK(d.events == d.count);
+        CHECK(d.count <= THREADS * (RING_EVENTS - 1));
+        free(d.text);
+    }
+    atomic_store(&stop, true);
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    dump_t d = dump();
+    CHECK(d.valid);
+    CHECK(count_substr(d.text, "\"name\":\"thread_name\"") == THREADS);
+    free(d.text);
+}
+
+static void test_ring_overrun(void)
+{
+    /* the ring keeps the newest events but one, the rest are counted as dropped */
+    pthread_t thread;
+    worker_t worker = { 0 };
+    start_worker(&thread, &worker, "overrun", 3 * RING_EVENTS - 1);
+    pthread_join(thread, NULL);
+    dump_t d = dump();
+    CHECK(d.valid);
+    CHECK(d.count == RING_EVENTS - 1);
+    CHECK(d.dropped == 3 * RING_EVENTS - d.count);
+    free(d.text);
+
+    d = dump();
+    CHECK(d.valid && d.count == 0 && d.dropped == 0);
+    free(d.text);
+}
+
+static void test_too_many_threads(void)
+{
+    /* more threads are alive than there are rings, the ones without a ring count as dropped */
+    enum { THREADS = MAX_THREADS + 4, EVENTS = 9 };
+    pthread_t threads[THREADS];
+    worker_t workers[THREADS] = { 0 };
+    pthread_barrier_t recorded;
+    pthread_barrier_init(&recorded, NULL, THREADS);
+    for (int i = 0; i < THREADS; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "slot %d", i);
+        workers[i].recorded = &recorded;
+        start_worker(&threads[i], &workers[i], name, EVENTS);
+    }
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&recorded);
+    dump_t d = dump();
+    CHECK(d.valid);
+    CHECK(d.count == MAX_THREADS * (1 + EVENTS));
+    CHECK(d.dropped == (THREADS - MAX_THREADS) * (1 + EVENTS));
+    CHECK(count_substr(d.text, "\"name\":\"thread_name\"") == MAX_THREADS);
+    free(d.text);
+}
+
+static void test_take_over_ring(void)
+{
+    /* all rings are held but one, of an exited thread: a new thread takes it over,
+     * dropping the events it held which weren't dumped yet
+     */
+    enum { HOLDERS = MAX_THREADS - 1, EXITED_EVENTS = 5, NEW_EVENTS = 2 };
+    pthread_t holders[HOLDERS], exited, taker;
+    worker_t holder_workers[HOLDERS] = { 0 }, exited_worker = { 0 }, taker_worker = { 0 };
+    pthread_barrier_t recorded, release;
+    pthread_barrier_init(&recorded, NULL, HOLDERS + 2);
+    pthread_barrier_init(&release, NULL, HOLDERS + 1);
+    for (int i = 0; i < HOLDERS; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "holder %d", i);
+        holder_workers[i].recorded = &recorded;
+        holder_workers[i].release = &release;
+        start_worker(&holders[i], &holder_workers[i], name, 0);
+    }
+    exited_worker.recorded = &recorded;
+    start_worker(&exited, &exited_worker, "exited", EXITED_EVENTS);
+    pthread_barrier_wait(&recorded);
+    pthread_join(exited, NULL);
+
+    start_worker(&taker, &taker_worker, "taker", NEW_EVENTS - 1);
+    pthread_join(taker, NULL);
+    pthread_barrier_wait(&release);
+    for (int i = 0; i < HOLDERS; ++i) {
+        pthread_join(holders[i], NULL);
+    }
+    pthread_barrier_destroy(&recorded);
+    pthread_barrier_destroy(&release);
+
+    dump_t d = dump();
+    CHECK(d.valid);
+    CHECK(d.count == HOLDERS + NEW_EVENTS);
+    CHECK(d.dropped == 1 + EXITED_EVENTS);
+    CHECK(dump_has_thread(&d, "taker"));
+    CHECK(!dump_has_thread(&d, "exited"));
+    free(d.text);
+}
+
+static void test_same_name_continues(void)
+{
+    /* a thread of the same name continues in its predecessor's ring, without drops */
+    pthread_t thread;
+    worker_t worker = { 0 };
+    start_worker(&thread, &worker, "taker", 3);
+    pthread_join(thread, NULL);
+    start_worker(&thread, &worker, "taker", 3);
+    pthread_join(thread, NULL);
+    dump_t d = dump();
+    CHECK(d.valid);
+    CHECK(d.count == 8);
+    CHECK(d.dropped == 0);
+    CHECK(count_substr(d.text, "\"args\":{\"name\":\"taker\"}") == 1);
+    free(d.text);
+}
+
+int main(void)
+{
+    test_record_and_dump();
+    test_dump_while_recording();
+    test_ring_overrun();
+    test_too_many_threads();
+    test_take_over_ring();
+    test_same_name_continues();
+    remove(DUMP_PATH);
+    if (s_failures != 0) {
+        printf("%d checks failed\n", s_failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,313 @@
+// Host tests of the module decoder: plain, gzip and LZ4 files produced by the
+// gzip and lz4 tools must decode back to the original bytes, whatever the chunk
+// sizes the reader asks for, and wasm_probe_file() must only accept archives of
+// a module. The ROM inflate is replaced by zlib, see stubs/esp32s2/rom/miniz.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "stubs.h"
+#include "wasm_stream.h"
+
+static int s_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            s_failures++; \
+        } \
+    } while (0)
+
+typedef std::vector<uint8_t> bytes_t;
+
+/***** test data *****/
+
+static uint32_t s_random = 12345;
+
+static uint8_t next_random(void)
+{
+    s_random = s_random * 1103515245u + 12345u;
+    return (uint8_t) (s_random >> 16);
+}
+
+/* module header followed by text-like data, compresses well and has long matches */
+static bytes_t make_module(size_t size)
+{
+    static const char* const words[] = { "local.get ", "i32.const ", "call ", "br_if ", "end\n", "memory.grow ", "(func $" };
+    bytes_t data = { 0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00 };
+    while (data.size() < size) {
+        const char* word = words[next_random() % 7];
+        data.insert(data.end(), word, word + strlen(word));
+        data.push_back('0' + next_random() % 10);
+    }
+    data.resize(size);
+    return data;
+}
+
+/* module header followed by random bytes, the compressors store these uncompressed */
+static bytes_t make_random_module(size_t size)
+{
+    bytes_t data = make_module(8);
+    while (data.size() < size) {
+        data.push_back(next_random());
+    }
+    return data;
+}
+
+static bytes_t make_text(size_t size)
+{
+    bytes_t data = make_module(size + 8);
+    data.erase(data.begin(), data.begin() + 8);
+    return data;
+}
+
+static void write_file(const char* path, const bytes_t& data)
+{
+    FILE* f = fopen(path, "wb");
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+}
+
+static bytes_t read_file(const char* path)
+{
+    bytes_t data;
+    FILE* f = fopen(path, "rb");
+    if (f != NULL) {
+        int c;
+        while ((c = fgetc(f)) != EOF) {
+            data.push_back((uint8_t) c);
+        }
+        fclose(f);
+    }
+    return data;
+}
+
+/* runs a compressor from the command line, false if it isn't installed */
+static bool compress_file(const char* tool, const char* args, const bytes_t& data, const char* out_path)
+{
+    if (tool[0] == 0) {
+        return false;
+    }
+    write_file("test_input.bin", data);
+    std::string cmd = std::string("\"") + tool + "\" -q " + args + " -c test_input.bin > " + out_path;
+    bool ok = system(cmd.c_str()) == 0;
+    remove("test_input.bin");
+    CHECK(ok);
+    return ok;
+}
+
+/* gzip header fields the gzip tool doesn't write, through zlib's gzip wrapper */
+static bytes_t gzip_with_header(const bytes_t& data)
+{
+    z_stream stream = {};
+    deflateInit2(&stream, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    static char name[] = "module.wasm";
+    static char comment[] = "built for the demo";
+    static Bytef extra[] = { 'W', 'A', 4, 0, 1, 2, 3, 4 };
+    gz_header header = {};
+    header.name = (Bytef*) name;
+    header.comment = (Bytef*) comment;
+    header.extra = extra;
+    header.extra_len = sizeof(extra);
+    header.hcrc = 1;
+    deflateSetHeader(&stream, &header);
+    bytes_t out(deflateBound(&stream, data.size()) + 256);
+    stream.next_in = (Bytef*) data.data();
+    stream.avail_in = data.size();
+    stream.next_out = out.data();
+    stream.avail_out = out.size();
+    CHECK(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+
+/***** decoding *****/
+
+struct decoded_t {
+    wasm_format_t format;
+    bool failed;
+    size_t uncompressed_size;
+    bytes_t data;
+};
+
+/* reads the whole file through wasm_streambuf, in chunks cycling through chunk_sizes */
+static decoded_t decode(const char* path, const std::vector<size_t>& chunk_sizes)
+{
+    decoded_t result;
+    wasm_streambuf buf(fopen(path, "rb"));
+    std::vector<char> chunk(128 * 1024);
+    for (size_t i = 0; ; ++i) {
+        size_t want = chunk_sizes[i % chunk_sizes.size()];
+        std::streamsize n = buf.sgetn(chunk.data(), want);
+        result.data.insert(result.data.end(), chunk.data(), chunk.data() + n);
+        if ((size_t) n < want) {
+            break;
+        }
+    }
+    result.format = buf.format();
+    result.failed = buf.failed();
+    result.uncompressed_size = buf.uncompressed_size();
+    return result;
+}
+
+static void check_round_trip(const char* path, const bytes_t& expected, wasm_format_t format)
+{
+    /* a byte at a time, odd sizes across window boundaries, and what wasm.cpp reads */
+    for (const std::vector<size_t>& chunks : std::vector<std::vector<size_t>>{ {1}, {7, 4093, 65537}, {64 * 1024} }) {
+        decoded_t d = decode(path, chunks);
+        CHECK(d.format == format);
+        CHECK(!d.failed);
+        CHECK(d.uncompressed_size == expected.size());
+        CHECK(d.data == expected);
+    }
+}
+
+/***** tests *****/
+
+static void test_plain(void)
+{
+    bytes_t module = make_module(10000);
+    write_file("test.wasm", module);
+    check_round_trip("test.wasm", module, WASM_FORMAT_PLAIN);
+    CHECK(wasm_file_format("test.wasm") == WASM_FORMAT_PLAIN);
+    CHECK(wasm_probe_file("test.wasm") == WASM_FORMAT_PLAIN);
+    remove("test.wasm");
+}
+
+static void test_gzip(void)
+{
+    const std::vector<bytes_t> inputs = { make_module(100), make_module(200 * 1024), make_random_module(100 * 1024) };
+    for (const char* args : { "-1", "-9" }) {
+        for (const bytes_t& input : inputs) {
+            if (!compress_file(GZIP_PROGRAM, args, input, "test.wasm.gz")) {
+                printf("gzip not found, skipping gzip tool output\n");
+                return;
+            }
+            check_round_trip("test.wasm.gz", input, WASM_FORMAT_GZIP);
+        }
+    }
+    remove("test.wasm.gz");
+}
+
+static void test_gzip_header_fields(void)
+{
+    bytes_t module = make_module(50 * 1024);
+    write_file("test.wasm.gz", gzip_with_header(module));
+    check_round_trip("test.wasm.gz", module, WASM_FORMAT_GZIP);
+    remove("test.wasm.gz");
+}
+
+static void test_lz4(void)
+{
+    const std::vector<bytes_t> inputs = { make_module(100), make_module(300 * 1024), make_random_module(100 * 1024) };
+    /* independent and linked blocks, block and content checksums, content size */
+    for (const char* args : { "", "-9 -BD", "-B4 -BD -BX --content-size", "-B5 --no-frame-crc" }) {
+        for (const bytes_t& input : inputs) {
+            if (!compress_file(LZ4_PROGRAM, args, input, "test.wasm.lz4")) {
+                printf("lz4 not found, skipping lz4 tool output\n");
+                return;
+            }
+            check_round_trip("test.wasm.lz4", input, WASM_FORMAT_LZ4);
+        }
+    }
+
+    /* concatenated frames decode to the concatenated contents */
+    bytes_t first = make_module(70 * 1024);
+    bytes_t second = make_text(30 * 1024);
+    compress_file(LZ4_PROGRAM, "-BD", first, "test.wasm.lz4");
+    bytes_t frames = read_file("test.wasm.lz4");
+    compress_file(LZ4_PROGRAM, "-BX", second, "test.wasm.lz4");
+    bytes_t frame = read_file("test.wasm.lz4");
+    frames.insert(frames.end(), frame.begin(), frame.end());
+    write_file("test.wasm.lz4", frames);
+    first.insert(first.end(), second.begin(), second.end());
+    check_round_trip("test.wasm.lz4", first, WASM_FORMAT_LZ4);
+    remove("test.wasm.lz4");
+}
+
+static void test_probe(void)
+{
+    /* archives of something else are seen as compressed by the header, but aren't modules */
+    stub_clear_log();
+    write_file("test.txt.gz", gzip_with_header(make_text(1000)));
+    CHECK(wasm_file_format("test.txt.gz") == WASM_FORMAT_GZIP);
+    CHECK(wasm_probe_file("test.txt.gz") == WASM_FORMAT_UNKNOWN);
+    CHECK(strstr(stub_log_text(), "test.txt.gz is not a module") != NULL);
+    CHECK(strstr(stub_log_text(), "Failed to read") == NULL);
+    remove("test.txt.gz");
+
+    write_file("test.wasm.gz", gzip_with_header(make_module(1000)));
+    CHECK(wasm_probe_file("test.wasm.gz") == WASM_FORMAT_GZIP);
+    remove("test.wasm.gz");
+
+    if (compress_file(LZ4_PROGRAM, "", make_text(1000), "test.txt.lz4")) {
+        CHECK(wasm_probe_file("test.txt.lz4") == WASM_FORMAT_UNKNOWN);
+        compress_file(LZ4_PROGRAM, "", make_module(1000), "test.wasm.lz4");
+        CHECK(wasm_probe_file("test.wasm.lz4") == WASM_FORMAT_LZ4);
+        remove("test.txt.lz4");
+        remove("test.wasm.lz4");
+    }
+
+    /* a gzip header with a broken stream behind it */
+    stub_clear_log();
+    write_file("test.bad.gz", bytes_t{ 0x1f, 0x8b, 0x08, 0, 0, 0, 0, 0, 0, 3, 0xff, 0xff, 0xff, 0xff });
+    CHECK(wasm_probe_file("test.bad.gz") == WASM_FORMAT_UNKNOWN);
+    CHECK(strstr(stub_log_text(), "test.bad.gz is not a module") != NULL);
+    CHECK(strstr(stub_log_text(), "Failed to read") == NULL);
+    remove("test.bad.gz");
+
+    write_file("test.bin", make_text(100));
+    CHECK(wasm_probe_file("test.bin") == WASM_FORMAT_UNKNOWN);
+    remove("test.bin");
+    CHECK(wasm_probe_file("does-not-exist.wasm") == WASM_FORMAT_UNKNOWN);
+}
+
+static void test_truncated(void)
+{
+    /* the module header decodes, the rest of the file is missing */
+    bytes_t module = make_module(100 * 1024);
+    bytes_t gz = gzip_with_header(module);
+    gz.resize(gz.size() / 2);
+    write_file("test.wasm.gz", gz);
+    CHECK(wasm_probe_file("test.wasm.gz") == WASM_FORMAT_GZIP);
+    stub_clear_log();
+    decoded_t d = decode("test.wasm.gz", { 4096 });
+    CHECK(d.failed);
+    CHECK(d.data.size() < module.size());
+    CHECK(memcmp(d.data.data(), module.data(), d.data.size()) == 0);
+    CHECK(strstr(stub_log_text(), "Failed to read gzip module: truncated deflate stream") != NULL);
+    remove("test.wasm.gz");
+
+    if (compress_file(LZ4_PROGRAM, "", module, "test.wasm.lz4")) {
+        bytes_t lz4 = read_file("test.wasm.lz4");
+        lz4.resize(lz4.size() / 2);
+        write_file("test.wasm.lz4", lz4);
+        stub_clear_log();
+        d = decode("test.wasm.lz4", { 4096 });
+        CHECK(d.failed);
+        CHECK(memcmp(d.data.data(), module.data(), d.data.size()) == 0);
+        CHECK(strstr(stub_log_text(), "Failed to read lz4 module: truncated LZ4") != NULL);
+        remove("test.wasm.lz4");
+    }
+}
+
+int main(void)
+{
+    stub_reset();
+    test_plain();
+    test_gzip();
+    test_gzip_header_fields();
+    test_lz4();
+    test_probe();
+    test_truncated();
+    if (s_failures != 0) {
+        printf("%d checks failed\n", s_failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
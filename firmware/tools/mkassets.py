@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Packs files into an image for the "assets" partition.
+
+Copy the image to the USB drive as ASSETS.BIN, the firmware imports it on the
+next mount. Or flash it directly:
+
+    parttool.py write_partition --partition-name=assets --input=ASSETS.BIN
+
+The layout must match firmware/main/assets.c.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x54534157          # "WAST"
+VERSION = 1
+NAME_LEN = 24
+MAX_COUNT = 256
+ALIGN = 4
+
+HEADER = struct.Struct("<IIIII")            # magic, version, count, crc, total size
+ENTRY = struct.Struct("<%dsII" % NAME_LEN)  # name, offset, size
+
+
+def align(value):
+    return (value + ALIGN - 1) & ~(ALIGN - 1)
+
+
+def build(files):
+    if len(files) > MAX_COUNT:
+        raise ValueError("at most %d assets are supported" % MAX_COUNT)
+    entries = []
+    data = bytearray()
+    offset = align(HEADER.size + ENTRY.size * len(files))
+    for path in files:
+        name = os.path.basename(path).encode()
+        if len(name) > NAME_LEN:
+            raise ValueError("asset name %s is longer than %d bytes" % (name.decode(), NAME_LEN))
+        with open(path, "rb") as f:
+            contents = f.read()
+        entries.append(ENTRY.pack(name, offset + len(data), len(contents)))
+        data += contents
+        data += bytes(align(len(data)) - len(data))
+
+    body = b"".join(entries)
+    body += bytes(align(HEADER.size + len(body)) - HEADER.size - len(body))
+    body += data
+    total_size = HEADER.size + len(body)
+    return HEADER.pack(MAGIC, VERSION, len(files), zlib.crc32(body), total_size) + body
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-o", "--output", default="ASSETS.BIN", help="output image (default: ASSETS.BIN)")
+    parser.add_argument("--max-size", type=lambda s: int(s, 0), default=0x100000,
+                        help="size of the assets partition (default: 0x100000)")
+    parser.add_argument("files", nargs="+", help="files to pack, looked up by their base name")
+    args = parser.parse_args()
+
+    image = build(args.files)
+    if len(image) > args.max_size:
+        sys.exit("image is %d bytes, the partition only has %d" % (len(image), args.max_size))
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("%s: %d assets, %d bytes" % (args.output, len(args.files), len(image)))
+
+
+if __name__ == "__main__":
+    main()
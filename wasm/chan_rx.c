@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include "channels.h"
+
+/* Channel benchmark, receiving side, see chan_tx.c */
+
+#define MSG_SIZE    64
+
+int main(void)
+{
+    char msg[MSG_SIZE];
+
+    /* receives until the sender closes the channel */
+    int data = channel_open("bench", CHANNEL_RECEIVE, MSG_SIZE, 32);
+    int count = 0;
+    while (channel_recv(data, msg, MSG_SIZE, -1) >= 0) {
+        count++;
+    }
+    channel_close(data);
+
+    int ping = channel_open("ping", CHANNEL_RECEIVE, MSG_SIZE, 1);
+    int pong = channel_open("pong", CHANNEL_SEND, MSG_SIZE, 1);
+    int size;
+    while ((size = channel_recv(ping, msg, MSG_SIZE, -1)) >= 0) {
+        channel_send(pong, msg, size, -1);
+    }
+    channel_close(ping);
+    channel_close(pong);
+    printf("chan_rx done, %d messages received\n", count);
+    return 0;
+}
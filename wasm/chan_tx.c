@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <string.h>
+#include "channels.h"
+
+/* Channel benchmark, sending side. Runs together with chan_rx.wasm:
+ * set run_modules=chan_tx.wasm,chan_rx.wasm in settings.txt.
+ * The firmware prints messages per second and latency of each channel.
+ */
+
+#define MESSAGES    10000
+#define ROUND_TRIPS 1000
+#define MSG_SIZE    64
+
+int main(void)
+{
+    char msg[MSG_SIZE] = {0};
+
+    /* throughput: the receiver takes messages as fast as they come */
+    int data = channel_open("bench", CHANNEL_SEND, MSG_SIZE, 32);
+    for (int i = 0; i < MESSAGES; ++i) {
+        memcpy(msg, &i, sizeof(i));
+        if (channel_send(data, msg, MSG_SIZE, -1) != 0) {
+            puts("send failed");
+            return 1;
+        }
+    }
+    channel_close(data);
+
+    /* latency: one message in flight at a time */
+    int ping = channel_open("ping", CHANNEL_SEND, MSG_SIZE, 1);
+    int pong = channel_open("pong", CHANNEL_RECEIVE, MSG_SIZE, 1);
+    for (int i = 0; i < ROUND_TRIPS; ++i) {
+        if (channel_send(ping, msg, MSG_SIZE, -1) != 0 || channel_recv(pong, msg, MSG_SIZE, -1) < 0) {
+            puts("round trip failed");
+            break;
+        }
+    }
+    channel_close(ping);
+    channel_close(pong);
+    puts("chan_tx done");
+    return 0;
+}
@@ -0,0 +1,9 @@
+/* Channels between modules running at the same time, see README.md */
+#define CHANNEL_SEND        1
+#define CHANNEL_RECEIVE     2
+#define CHANNEL_TIMED_OUT   (-2)
+
+extern int channel_open(const char* name, int mode, int msg_size, int capacity);
+extern int channel_send(int ch, const void* buf, int size, int timeout_ms);
+extern int channel_recv(int ch, void* buf, int size, int timeout_ms);
+extern void channel_close(int ch);